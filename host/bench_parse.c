@@ -0,0 +1,99 @@
+// Microbenchmark of the text command parser
+//
+// Runs each command through handle_msg() repeatedly and reports the mean
+// cost per command. The firmware modules are linked against the simulated
+// peripherals, so commands take effect on simulated registers, but no
+// interrupts are run.
+
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#define CYCLES_LABEL "cycles"
+#else
+#define CYCLES_LABEL "ns"
+#endif
+
+#include "../src/msg_handler.h"
+#include "../src/output.h"
+#include "../src/analogue.h"
+#include "../src/config.h"
+
+#define DEFAULT_ITERATIONS 200000
+#define MSG_MAXLEN 64
+#define RESPONSE_LEN 64
+
+static const char* const commands[] = {
+    "*IDN?",
+    "*STATUS?",
+    "*TELEM?",
+    "MOT:0:SET:500",
+    "MOT:1:SET:-1000",
+    "MOT:ALL:SET:250:-250",
+    "MOT:0:GET?",
+    "MOT:1:I?",
+    "MOT:0:DISABLE",
+    "MOT:1:ISET?",
+    "MOT:0:GAIN:13:2",
+    "MOT:1:GAIN?",
+    "MOT:0:RAMP:0:0",
+    "MOT:0:RAMP?",
+    "CAP:STATE?",
+    "ECHO:hello",
+    "MOT:5:SET:0",
+    "MOT:0:SET:2000",
+    "BOGUS",
+};
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t cycles(void) {
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return monotonic_ns();
+#endif
+}
+
+int main(int argc, char** argv) {
+    unsigned long iterations = (argc > 1)?strtoul(argv[1], NULL, 0):DEFAULT_ITERATIONS;
+    char msg[MSG_MAXLEN];
+    char response[RESPONSE_LEN];
+    uint64_t total_ns = 0;
+
+    config_init();
+    output_init();
+    analogue_init();
+
+    printf("%-24s %10s %10s  %s\n", "command", "ns", CYCLES_LABEL, "response");
+    for (size_t i = 0; i < (sizeof(commands) / sizeof(commands[0])); i++) {
+        size_t len = strlen(commands[i]) + 1;
+
+        // Includes copying the line in, as the receive path does
+        uint64_t start_ns = monotonic_ns();
+        uint64_t start_cycles = cycles();
+        for (unsigned long n = 0; n < iterations; n++) {
+            memcpy(msg, commands[i], len);
+            handle_msg(msg, response, RESPONSE_LEN - 2);
+        }
+        uint64_t elapsed_cycles = cycles() - start_cycles;
+        uint64_t elapsed_ns = monotonic_ns() - start_ns;
+        total_ns += elapsed_ns;
+
+        printf("%-24s %10.1f %10.1f  %s\n", commands[i],
+            (double)elapsed_ns / iterations, (double)elapsed_cycles / iterations, response);
+    }
+    printf("%-24s %10.1f\n", "mean",
+        (double)total_ns / (iterations * (sizeof(commands) / sizeof(commands[0]))));
+    return 0;
+}
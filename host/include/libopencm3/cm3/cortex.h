@@ -0,0 +1,12 @@
+#pragma once
+
+#include <libopencm3/common.h>
+
+// Interrupts only run from sim_poll() so there is nothing to mask
+static inline void cm_enable_interrupts(void) {}
+static inline void cm_disable_interrupts(void) {}
+
+// Runs the simulation until an interrupt handler has been called
+void sim_wait_for_interrupt(void);
+
+#define CM_ATOMIC_BLOCK() for (int sim_atomic_once = 1; sim_atomic_once; sim_atomic_once = 0)
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <libopencm3/common.h>
+
+// The cycle counter runs from host time scaled to SIM_CLOCK_HZ
+bool dwt_enable_cycle_counter(void);
+uint32_t dwt_read_cycle_counter(void);
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <libopencm3/common.h>
+
+#define NVIC_DMA1_CHANNEL4_IRQ 14
+#define NVIC_ADC1_2_IRQ 18
+#define NVIC_TIM2_IRQ 28
+#define NVIC_TIM3_IRQ 29
+#define NVIC_USART1_IRQ 37
+
+void nvic_enable_irq(uint8_t irqn);
+void nvic_disable_irq(uint8_t irqn);
+uint8_t nvic_get_irq_enabled(uint8_t irqn);
+void nvic_set_priority(uint8_t irqn, uint8_t priority);
+
+// Interrupt handlers, called by the simulation
+void sys_tick_handler(void);
+void dma1_channel4_isr(void);
+void adc1_2_isr(void);
+void tim2_isr(void);
+void tim3_isr(void);
+void usart1_isr(void);
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <libopencm3/common.h>
+
+void scb_reset_system(void) __attribute__((noreturn));
+
+// Replaces the jump into the system memory bootloader
+void sim_enter_bootloader(void) __attribute__((noreturn));
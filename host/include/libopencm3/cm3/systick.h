@@ -0,0 +1,12 @@
+#pragma once
+
+#include <libopencm3/common.h>
+
+#define STK_CSR_CLKSOURCE_AHB_DIV8 0
+#define STK_CSR_CLKSOURCE_AHB 1
+
+void systick_set_clocksource(uint8_t clocksource);
+void systick_set_reload(uint32_t value);
+void systick_clear(void);
+void systick_interrupt_enable(void);
+void systick_counter_enable(void);
@@ -0,0 +1,8 @@
+#pragma once
+// Host simulation shim of the libopencm3 headers used by the firmware
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "sim.h"
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <libopencm3/common.h>
+
+#define ADC1 1
+
+#define ADC_SR(adc) (sim_adc1.sr)
+#define ADC1_SR ADC_SR(ADC1)
+
+#define ADC_SR_STRT (1 << 4)
+#define ADC_SR_JSTRT (1 << 3)
+#define ADC_SR_JEOC (1 << 2)
+#define ADC_SR_EOC (1 << 1)
+#define ADC_SR_AWD (1 << 0)
+
+#define ADC_SMPR_SMP_1DOT5CYC 0x0
+#define ADC_SMPR_SMP_28DOT5CYC 0x3
+#define ADC_SMPR_SMP_239DOT5CYC 0x7
+
+#define ADC_CR2_JEXTSEL_TIM1_TRGO 0
+#define ADC_CR2_JEXTSEL_TIM1_CC4 1
+#define ADC_CR2_JEXTSEL_TIM2_TRGO 2
+#define ADC_CR2_JEXTSEL_TIM2_CC1 3
+#define ADC_CR2_JEXTSEL_JSWSTART 7
+#define ADC_CR2_EXTSEL_SWSTART 7
+
+void adc_power_off(uint32_t adc);
+void adc_power_on(uint32_t adc);
+void adc_set_sample_time_on_all_channels(uint32_t adc, uint8_t time);
+void adc_set_sample_time(uint32_t adc, uint8_t channel, uint8_t time);
+void adc_set_right_aligned(uint32_t adc);
+void adc_enable_eoc_interrupt(uint32_t adc);
+void adc_disable_eoc_interrupt(uint32_t adc);
+void adc_enable_external_trigger_injected(uint32_t adc, uint32_t trigger);
+void adc_enable_scan_mode(uint32_t adc);
+void adc_set_injected_sequence(uint32_t adc, uint8_t length, uint8_t channel[]);
+void adc_reset_calibration(uint32_t adc);
+void adc_calibrate(uint32_t adc);
+uint32_t adc_read_injected(uint32_t adc, uint8_t reg);
+void adc_enable_eoc_interrupt_injected(uint32_t adc);
+void adc_disable_eoc_interrupt_injected(uint32_t adc);
+void adc_set_regular_sequence(uint32_t adc, uint8_t length, uint8_t channel[]);
+void adc_enable_external_trigger_regular(uint32_t adc, uint32_t trigger);
+void adc_start_conversion_regular(uint32_t adc);
+uint32_t adc_read_regular(uint32_t adc);
+void adc_enable_analog_watchdog_injected(uint32_t adc);
+void adc_disable_analog_watchdog_injected(uint32_t adc);
+void adc_enable_analog_watchdog_on_all_channels(uint32_t adc);
+void adc_set_watchdog_high_threshold(uint32_t adc, uint16_t threshold);
+void adc_set_watchdog_low_threshold(uint32_t adc, uint16_t threshold);
+void adc_enable_awd_interrupt(uint32_t adc);
+void adc_disable_awd_interrupt(uint32_t adc);
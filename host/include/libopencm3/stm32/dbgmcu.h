@@ -0,0 +1,8 @@
+#pragma once
+
+#include <libopencm3/common.h>
+
+#define DBGMCU_CR sim_dbgmcu_cr
+#define DBGMCU_CR_TIM1_STOP (1 << 10)
+#define DBGMCU_CR_TIM2_STOP (1 << 11)
+#define DBGMCU_CR_TIM3_STOP (1 << 12)
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <libopencm3/common.h>
+
+#define BKP_DR1 (sim_bkp[1])
+#define BKP_DR2 (sim_bkp[2])
+#define BKP_DR3 (sim_bkp[3])
+#define BKP_DR4 (sim_bkp[4])
+#define BKP_DR5 (sim_bkp[5])
+#define BKP_DR6 (sim_bkp[6])
+#define BKP_DR7 (sim_bkp[7])
+#define BKP_DR8 (sim_bkp[8])
+#define BKP_DR9 (sim_bkp[9])
+#define BKP_DR10 (sim_bkp[10])
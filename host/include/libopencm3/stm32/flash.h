@@ -0,0 +1,14 @@
+#pragma once
+
+#include <libopencm3/common.h>
+
+#define FLASH_SR_EOP (1 << 5)
+#define FLASH_SR_WRPRTERR (1 << 4)
+#define FLASH_SR_PGERR (1 << 2)
+
+void flash_unlock(void);
+void flash_lock(void);
+void flash_erase_page(uint32_t page_address);
+void flash_program_half_word(uint32_t address, uint16_t data);
+uint32_t flash_get_status_flags(void);
+void flash_clear_status_flags(void);
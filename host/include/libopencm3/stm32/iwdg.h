@@ -0,0 +1,9 @@
+#pragma once
+
+#include <libopencm3/common.h>
+
+void iwdg_set_period_ms(uint32_t period);
+void iwdg_start(void);
+void iwdg_reset(void);
+bool iwdg_prescaler_busy(void);
+bool iwdg_reload_busy(void);
@@ -0,0 +1,6 @@
+#pragma once
+
+#include <libopencm3/common.h>
+
+void pwr_disable_backup_domain_write_protect(void);
+void pwr_enable_backup_domain_write_protect(void);
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <libopencm3/common.h>
+
+enum rcc_periph_clken {
+    RCC_GPIOA, RCC_GPIOB, RCC_GPIOC, RCC_AFIO,
+    RCC_PWR, RCC_BKP, RCC_DMA1,
+    RCC_TIM1, RCC_TIM2, RCC_TIM3, RCC_ADC1, RCC_USART1,
+};
+
+struct rcc_clock_scale {
+    uint32_t ahb_frequency;
+};
+
+enum rcc_clock_hse {
+    RCC_CLOCK_HSE8_24MHZ,
+    RCC_CLOCK_HSE_END
+};
+extern const struct rcc_clock_scale rcc_hse_configs[RCC_CLOCK_HSE_END];
+
+#define RCC_APB2ENR sim_rcc_apb2enr
+#define RCC_APB2ENR_USART1EN (1 << 14)
+#define RCC_CSR sim_rcc_csr
+#define RCC_CSR_LPWRRSTF (1u << 31)
+#define RCC_CSR_WWDGRSTF (1 << 30)
+#define RCC_CSR_IWDGRSTF (1 << 29)
+#define RCC_CSR_SFTRSTF (1 << 28)
+#define RCC_CSR_PORRSTF (1 << 27)
+#define RCC_CSR_PINRSTF (1 << 26)
+#define RCC_CSR_RMVF (1 << 24)
+#define RCC_CFGR_ADCPRE_PCLK2_DIV2 0x0
+
+void rcc_clock_setup_pll(const struct rcc_clock_scale* clock);
+void rcc_periph_clock_enable(enum rcc_periph_clken clken);
+void rcc_peripheral_enable_clock(volatile uint32_t* reg, uint32_t en);
+void rcc_set_adcpre(uint32_t adcpre);
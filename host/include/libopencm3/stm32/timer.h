@@ -0,0 +1,67 @@
+#pragma once
+
+#include <libopencm3/common.h>
+
+#define TIM1 1
+#define TIM2 2
+#define TIM3 3
+
+#define TIM_PSC(tim) (sim_timers[tim].psc)
+#define TIM_ARR(tim) (sim_timers[tim].arr)
+#define TIM_DIER(tim) (sim_timers[tim].dier)
+#define TIM_SR(tim) (sim_timers[tim].sr)
+
+enum tim_oc_id {
+    TIM_OC1 = 0,
+    TIM_OC2,
+    TIM_OC3,
+    TIM_OC4,
+};
+
+#define TIM_CR1_CKD_CK_INT 0
+#define TIM_CR1_CMS_EDGE 0
+#define TIM_CR1_DIR_UP 0
+
+#define TIM_CR2_MMS_RESET 0
+#define TIM_CR2_MMS_ENABLE 1
+#define TIM_CR2_MMS_UPDATE 2
+#define TIM_CR2_MMS_COMPARE_PULSE 3
+#define TIM_CR2_MMS_COMPARE_OC1REF 4
+#define TIM_CR2_MMS_COMPARE_OC2REF 5
+#define TIM_CR2_MMS_COMPARE_OC3REF 6
+#define TIM_CR2_MMS_COMPARE_OC4REF 7
+
+#define TIM_OCM_FROZEN 0
+#define TIM_OCM_PWM1 6
+#define TIM_OCM_PWM2 7
+
+#define TIM_DIER_UIE (1 << 0)
+#define TIM_DIER_CC1IE (1 << 1)
+#define TIM_DIER_CC2IE (1 << 2)
+
+#define TIM_SR_UIF (1 << 0)
+#define TIM_SR_CC1IF (1 << 1)
+#define TIM_SR_CC2IF (1 << 2)
+
+#define TIM_EGR_UG (1 << 0)
+
+void timer_set_mode(uint32_t tim, uint32_t clock_div, uint32_t alignment, uint32_t direction);
+void timer_set_prescaler(uint32_t tim, uint32_t value);
+void timer_set_period(uint32_t tim, uint32_t period);
+void timer_set_oc_mode(uint32_t tim, enum tim_oc_id oc_id, uint32_t oc_mode);
+void timer_set_oc_value(uint32_t tim, enum tim_oc_id oc_id, uint32_t value);
+void timer_set_oc_polarity_high(uint32_t tim, enum tim_oc_id oc_id);
+void timer_enable_oc_preload(uint32_t tim, enum tim_oc_id oc_id);
+void timer_disable_oc_preload(uint32_t tim, enum tim_oc_id oc_id);
+void timer_enable_oc_output(uint32_t tim, enum tim_oc_id oc_id);
+void timer_set_master_mode(uint32_t tim, uint32_t mode);
+void timer_enable_preload(uint32_t tim);
+void timer_enable_counter(uint32_t tim);
+void timer_disable_counter(uint32_t tim);
+void timer_set_counter(uint32_t tim, uint32_t count);
+uint32_t timer_get_counter(uint32_t tim);
+void timer_generate_event(uint32_t tim, uint32_t event);
+void timer_enable_irq(uint32_t tim, uint32_t irq);
+void timer_disable_irq(uint32_t tim, uint32_t irq);
+bool timer_get_flag(uint32_t tim, uint32_t flag);
+void timer_clear_flag(uint32_t tim, uint32_t flag);
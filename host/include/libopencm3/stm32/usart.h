@@ -0,0 +1,38 @@
+#pragma once
+
+#include <libopencm3/common.h>
+
+#define USART1 1
+
+#define USART_SR(usart) (sim_usart1.sr)
+#define USART_DR(usart) (sim_usart1.dr)
+
+#define USART_SR_TXE (1 << 7)
+#define USART_SR_TC (1 << 6)
+#define USART_SR_RXNE (1 << 5)
+#define USART_SR_IDLE (1 << 4)
+#define USART_SR_ORE (1 << 3)
+#define USART_SR_NE (1 << 2)
+#define USART_SR_FE (1 << 1)
+#define USART_SR_PE (1 << 0)
+
+#define USART_STOPBITS_1 0
+#define USART_PARITY_NONE 0
+#define USART_FLOWCONTROL_NONE 0
+#define USART_MODE_TX_RX 0
+
+void usart_set_baudrate(uint32_t usart, uint32_t baud);
+void usart_set_databits(uint32_t usart, uint32_t bits);
+void usart_set_stopbits(uint32_t usart, uint32_t stopbits);
+void usart_set_parity(uint32_t usart, uint32_t parity);
+void usart_set_flow_control(uint32_t usart, uint32_t flowcontrol);
+void usart_set_mode(uint32_t usart, uint32_t mode);
+void usart_enable(uint32_t usart);
+void usart_disable(uint32_t usart);
+uint16_t usart_recv(uint32_t usart);
+void usart_send_blocking(uint32_t usart, uint16_t data);
+void usart_enable_rx_interrupt(uint32_t usart);
+void usart_disable_rx_interrupt(uint32_t usart);
+void usart_enable_tx_dma(uint32_t usart);
+void usart_disable_tx_dma(uint32_t usart);
+bool usart_get_flag(uint32_t usart, uint32_t flag);
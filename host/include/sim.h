@@ -0,0 +1,74 @@
+#pragma once
+// State of the simulated peripherals, shared between the libopencm3 shim
+// headers and sim.c
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define SIM_CLOCK_HZ 24000000
+
+typedef struct {
+    volatile uint32_t sr;
+    volatile uint32_t dr;
+    uint32_t baudrate;
+    bool enabled;
+    bool rx_interrupt;
+    bool tx_dma;
+} sim_usart_t;
+
+typedef struct {
+    uint32_t psc;
+    uint32_t arr;
+    uint32_t ccr[4];
+    uint32_t oc_mode[4];
+    uint32_t master_mode;
+    uint32_t cnt;  // only counted for TIM3
+    volatile uint32_t dier;
+    volatile uint32_t sr;
+    bool enabled;
+} sim_timer_t;
+
+typedef struct {
+    volatile uint32_t sr;
+    uint8_t injected_seq[4];
+    uint8_t injected_len;
+    uint32_t injected_trigger;
+    volatile uint32_t jdr[4];
+    uint8_t regular_seq[16];
+    uint8_t regular_len;
+    uint32_t regular_trigger;
+    volatile uint32_t dr;
+    bool eoc_interrupt;
+    bool jeoc_interrupt;
+    bool awd_interrupt;
+    bool awd_injected;  // the watchdog only covers injected conversions
+    uint16_t awd_high;
+    uint16_t awd_low;
+    bool powered;
+} sim_adc_t;
+
+typedef struct {
+    bool enabled;
+    bool tc_interrupt;
+    uint32_t peripheral_address;
+    uint32_t memory_address;
+    uint16_t count;
+    volatile uint32_t flags;
+} sim_dma_channel_t;
+
+extern sim_usart_t sim_usart1;
+extern sim_timer_t sim_timers[5];  // indexed by timer number
+extern sim_adc_t sim_adc1;
+extern sim_dma_channel_t sim_dma1[8];  // indexed by channel number
+extern volatile uint32_t sim_gpio_odr[3];  // GPIOA-C
+extern volatile uint32_t sim_bkp[11];  // BKP_DR1-10
+extern volatile uint32_t sim_dbgmcu_cr;
+extern volatile uint32_t sim_rcc_apb2enr;
+extern volatile uint32_t sim_rcc_csr;
+// Flash reserved for the configuration store, from _config_start as in
+// the linker script
+#define SIM_FLASH_PAGE_SIZE 1024
+#define SIM_CONFIG_FLASH_SIZE 2048
+
+void sim_poll(void);
@@ -0,0 +1,822 @@
+// Host simulation of the motor board peripherals
+//
+// The firmware runs unmodified on top of the libopencm3 shim headers in
+// include/. Interrupt handlers are called from sim_poll(), which the
+// firmware reaches whenever it services the watchdog, so they interleave
+// with the main loop much as they would on the board.
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sim.h"
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/usart.h>
+#include <libopencm3/stm32/timer.h>
+#include <libopencm3/stm32/adc.h>
+#include <libopencm3/stm32/iwdg.h>
+#include <libopencm3/stm32/pwr.h>
+#include <libopencm3/stm32/dma.h>
+#include <libopencm3/stm32/flash.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/scb.h>
+#include <libopencm3/cm3/systick.h>
+#include <libopencm3/cm3/dwt.h>
+#include <libopencm3/cm3/cortex.h>
+
+// main.c is built with main renamed
+int firmware_main(void);
+
+#define NS_PER_SEC 1000000000ULL
+// Don't try to catch up on more than this after the process was descheduled
+#define MAX_STEP_NS 50000000ULL
+// Board wiring of the ADC channels
+#define ADC_CHANNEL_12V 9
+#define ADC_CHANNEL_M1_CS 10
+#define ADC_CHANNEL_M0_CS 13
+
+sim_usart_t sim_usart1;
+sim_timer_t sim_timers[5];
+sim_adc_t sim_adc1;
+sim_dma_channel_t sim_dma1[8];
+volatile uint32_t sim_gpio_odr[3];
+volatile uint32_t sim_bkp[11];
+volatile uint32_t sim_dbgmcu_cr;
+volatile uint32_t sim_rcc_apb2enr;
+volatile uint32_t sim_rcc_csr = RCC_CSR_PORRSTF | RCC_CSR_PINRSTF;
+uint8_t _config_start[SIM_CONFIG_FLASH_SIZE] __attribute__((aligned(SIM_FLASH_PAGE_SIZE))) = {
+    [0 ... (SIM_CONFIG_FLASH_SIZE - 1)] = 0xFF,
+};
+
+const struct rcc_clock_scale rcc_hse_configs[RCC_CLOCK_HSE_END] = {
+    [RCC_CLOCK_HSE8_24MHZ] = {.ahb_frequency = SIM_CLOCK_HZ},
+};
+
+static struct {
+    int in_fd;
+    int out_fd;
+    bool pace;  // emulate the time taken to send each byte
+    bool exit_on_eof;
+    bool input_eof;
+    uint16_t fault_pins;  // GPIOB pins held low by a faulted H-bridge
+    const char* flash_path;  // keeps the configuration flash between runs
+} config = {
+    .in_fd = STDIN_FILENO,
+    .out_fd = STDOUT_FILENO,
+};
+
+// ADC sample source, cycled through one line per scan
+typedef struct {
+    uint16_t m0_ma;
+    uint16_t m1_ma;
+    uint16_t voltage_mv;
+} adc_sample_t;
+static adc_sample_t* adc_samples = NULL;
+static size_t adc_sample_count = 0;
+static size_t adc_sample_idx = 0;
+static adc_sample_t adc_constant = {.m0_ma = 0, .m1_ma = 0, .voltage_mv = 12000};
+static const adc_sample_t* adc_last_sample = &adc_constant;
+
+static bool flash_locked = true;
+static uint32_t flash_sr = 0;
+
+static uint32_t nvic_enabled[2];
+static bool systick_running = false;
+static bool systick_irq = false;
+static uint32_t systick_reload = 0;
+static bool iwdg_running = false;
+static uint32_t iwdg_period_ms = 0;
+static uint64_t iwdg_last_reset = 0;
+static bool iwdg_warned = false;
+
+static uint64_t sim_time = 0;  // ns
+static uint64_t last_poll = 0;
+static uint64_t systick_acc = 0;
+static uint64_t adc_acc = 0;
+static uint64_t tim2_acc = 0;
+static uint64_t tim3_acc = 0;
+static uint64_t rx_acc = 0;
+static uint64_t tx_acc = 0;
+static uint64_t eof_time = 0;
+static uint64_t interrupts_run = 0;
+
+static uint8_t rx_queue[4096];
+static size_t rx_queue_len = 0;
+
+// Status registers written directly by the firmware, the value last set by
+// the simulation, see sr_sync()
+static uint32_t usart_sr_published = 0;
+#define USART_SR_RC_W0 (USART_SR_TC | USART_SR_RXNE)
+static uint32_t adc_sr_published = 0;
+#define ADC_SR_RC_W0 (ADC_SR_AWD | ADC_SR_EOC | ADC_SR_JEOC | ADC_SR_JSTRT | ADC_SR_STRT)
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+static bool irq_enabled(uint8_t irqn) {
+    return nvic_enabled[irqn / 32] & (1u << (irqn % 32));
+}
+
+static void sr_sync(volatile uint32_t* sr, uint32_t* published, uint32_t rc_w0) {
+    // Merges a write by the firmware, writing 0 clears an rc_w0 flag and
+    // everything else ignores writes
+    *sr = *published & (*sr | ~rc_w0);
+    *published = *sr;
+}
+
+static void sr_modify(volatile uint32_t* sr, uint32_t* published, uint32_t rc_w0, uint32_t set, uint32_t clear) {
+    sr_sync(sr, published, rc_w0);
+    *sr = (*sr | set) & ~clear;
+    *published = *sr;
+}
+
+static void usart_sr_modify(uint32_t set, uint32_t clear) {
+    sr_modify(&sim_usart1.sr, &usart_sr_published, USART_SR_RC_W0, set, clear);
+}
+
+static void adc_sr_modify(uint32_t set, uint32_t clear) {
+    sr_modify(&sim_adc1.sr, &adc_sr_published, ADC_SR_RC_W0, set, clear);
+}
+
+static uint64_t byte_time_ns(void) {
+    // 8N1, 10 bits per byte
+    if (!config.pace || sim_usart1.baudrate == 0) {
+        return 0;
+    }
+    return (10 * NS_PER_SEC) / sim_usart1.baudrate;
+}
+
+static uint64_t timer_period_ns(uint32_t tim) {
+    const sim_timer_t* timer = &sim_timers[tim];
+    uint64_t ticks = (uint64_t)(timer->psc + 1) * (timer->arr + 1);
+    return (ticks * NS_PER_SEC) / SIM_CLOCK_HZ;
+}
+
+static uint16_t ma_to_code(uint16_t ma) {
+    uint32_t code = ((uint32_t)ma << 9) / 2625;
+    return (code > 0xfff)?(0xfff):(uint16_t)code;
+}
+
+static uint16_t mv_to_code(uint16_t mv) {
+    uint32_t code = ((uint32_t)mv << 9) / 2025;
+    return (code > 0xfff)?(0xfff):(uint16_t)code;
+}
+
+static uint16_t channel_code(const adc_sample_t* sample, uint8_t channel) {
+    switch (channel) {
+        case ADC_CHANNEL_12V:
+            return mv_to_code(sample->voltage_mv);
+        case ADC_CHANNEL_M0_CS:
+            return ma_to_code(sample->m0_ma);
+        case ADC_CHANNEL_M1_CS:
+            return ma_to_code(sample->m1_ma);
+        default:
+            return 0;
+    }
+}
+
+static void service_rx(uint64_t elapsed) {
+    if (!config.input_eof && rx_queue_len < sizeof(rx_queue)) {
+        ssize_t n = read(config.in_fd, &rx_queue[rx_queue_len], sizeof(rx_queue) - rx_queue_len);
+        if (n > 0) {
+            rx_queue_len += (size_t)n;
+        } else if (n == 0 && config.exit_on_eof) {
+            config.input_eof = true;
+            eof_time = sim_time;
+        }
+    }
+
+    uint64_t byte_time = byte_time_ns();
+    size_t deliver = rx_queue_len;
+    if (byte_time != 0) {
+        rx_acc += elapsed;
+        if (rx_queue_len == 0) {
+            rx_acc = 0;
+        }
+        if (deliver > rx_acc / byte_time) {
+            deliver = rx_acc / byte_time;
+        }
+        rx_acc -= deliver * byte_time;
+    }
+
+    for (size_t i = 0; i < deliver; i++) {
+        if (!sim_usart1.enabled) {
+            break;
+        }
+        sr_sync(&sim_usart1.sr, &usart_sr_published, USART_SR_RC_W0);
+        if (sim_usart1.sr & USART_SR_RXNE) {
+            // previous byte was never read
+            usart_sr_modify(USART_SR_ORE, 0);
+        } else {
+            sim_usart1.dr = rx_queue[i];
+            usart_sr_modify(USART_SR_RXNE, 0);
+        }
+        if (sim_usart1.rx_interrupt && irq_enabled(NVIC_USART1_IRQ)) {
+            usart1_isr();
+            interrupts_run++;
+        }
+    }
+    memmove(rx_queue, &rx_queue[deliver], rx_queue_len - deliver);
+    rx_queue_len -= deliver;
+}
+
+static void write_out(const uint8_t* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(config.out_fd, data, len);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                struct pollfd pfd = {.fd = config.out_fd, .events = POLLOUT};
+                poll(&pfd, 1, 10);
+                continue;
+            }
+            // nobody is listening, drop the data
+            return;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+static void service_tx(uint64_t elapsed) {
+    sim_dma_channel_t* dma = &sim_dma1[DMA_CHANNEL4];
+    if (!dma->enabled || dma->count == 0 || !sim_usart1.tx_dma) {
+        tx_acc = 0;
+        return;
+    }
+
+    uint64_t byte_time = byte_time_ns();
+    size_t send = dma->count;
+    if (byte_time != 0) {
+        tx_acc += elapsed;
+        if (send > tx_acc / byte_time) {
+            send = tx_acc / byte_time;
+        }
+        tx_acc -= send * byte_time;
+    }
+    if (send == 0) {
+        return;
+    }
+
+    write_out((const uint8_t*)(uintptr_t)dma->memory_address, send);
+    dma->memory_address += send;
+    dma->count -= send;
+
+    if (dma->count == 0) {
+        usart_sr_modify(USART_SR_TC, 0);
+        dma->flags |= DMA_TCIF | DMA_GIF;
+        if (dma->tc_interrupt && irq_enabled(NVIC_DMA1_CHANNEL4_IRQ)) {
+            dma1_channel4_isr();
+            interrupts_run++;
+        }
+    }
+}
+
+static void run_adc_scan(void) {
+    const adc_sample_t* sample = &adc_constant;
+    if (adc_sample_count != 0) {
+        sample = &adc_samples[adc_sample_idx];
+        adc_sample_idx = (adc_sample_idx + 1) % adc_sample_count;
+    }
+    // regular conversions started before the next scan use these inputs
+    adc_last_sample = sample;
+
+    for (uint8_t i = 0; i < sim_adc1.injected_len; i++) {
+        uint16_t code = channel_code(sample, sim_adc1.injected_seq[i]);
+        sim_adc1.jdr[i] = code;
+        if (sim_adc1.awd_injected && (code > sim_adc1.awd_high || code < sim_adc1.awd_low)) {
+            // On the device the interrupt is mid-scan, here it shares the end of scan one
+            adc_sr_modify(ADC_SR_AWD, 0);
+        }
+    }
+    adc_sr_modify(ADC_SR_JEOC | ADC_SR_JSTRT, 0);
+
+    bool interrupt = (sim_adc1.eoc_interrupt || sim_adc1.jeoc_interrupt)
+        || (sim_adc1.awd_interrupt && (sim_adc1.sr & ADC_SR_AWD));
+    if (interrupt && irq_enabled(NVIC_ADC1_2_IRQ)) {
+        adc1_2_isr();
+        interrupts_run++;
+    }
+}
+
+static uint32_t adc_trigger_timer(void) {
+    switch (sim_adc1.injected_trigger) {
+        case ADC_CR2_JEXTSEL_TIM1_TRGO:
+            return TIM1;
+        case ADC_CR2_JEXTSEL_TIM2_TRGO:
+            return TIM2;
+        default:
+            return 0;
+    }
+}
+
+static void service_timers(uint64_t elapsed) {
+    if (systick_running && systick_reload != 0) {
+        uint64_t period = ((uint64_t)(systick_reload + 1) * NS_PER_SEC) / SIM_CLOCK_HZ;
+        systick_acc += elapsed;
+        while (systick_acc >= period) {
+            systick_acc -= period;
+            if (systick_irq) {
+                sys_tick_handler();
+                interrupts_run++;
+            }
+        }
+    }
+
+    uint32_t adc_timer = adc_trigger_timer();
+    if (sim_adc1.powered && adc_timer != 0 && sim_timers[adc_timer].enabled) {
+        uint64_t period = timer_period_ns(adc_timer);
+        adc_acc += elapsed;
+        while (adc_acc >= period) {
+            adc_acc -= period;
+            run_adc_scan();
+        }
+    }
+
+    if (sim_timers[TIM2].enabled) {
+        uint64_t period = timer_period_ns(TIM2);
+        tim2_acc += elapsed;
+        while (tim2_acc >= period) {
+            tim2_acc -= period;
+            sim_timers[TIM2].sr |= TIM_SR_UIF;
+            if ((sim_timers[TIM2].dier & TIM_DIER_UIE) && irq_enabled(NVIC_TIM2_IRQ)) {
+                tim2_isr();
+                interrupts_run++;
+            }
+        }
+    }
+
+    // TIM3 is counted tick by tick, so its compare interrupts at the exact count
+    sim_timer_t* tim3 = &sim_timers[TIM3];
+    if (tim3->enabled) {
+        uint64_t tick = ((uint64_t)(tim3->psc + 1) * NS_PER_SEC) / SIM_CLOCK_HZ;
+        tim3_acc += elapsed;
+        while (tim3_acc >= tick) {
+            tim3_acc -= tick;
+            tim3->cnt = (tim3->cnt >= tim3->arr)?(0):(tim3->cnt + 1);
+            if (tim3->cnt == 0) {
+                tim3->sr |= TIM_SR_UIF;
+            }
+            if (tim3->cnt == tim3->ccr[TIM_OC1]) {
+                tim3->sr |= TIM_SR_CC1IF;
+            }
+            // The DIER enable bits line up with the SR flags
+            if ((tim3->sr & tim3->dier & (TIM_SR_UIF | TIM_SR_CC1IF)) && irq_enabled(NVIC_TIM3_IRQ)) {
+                tim3_isr();
+                interrupts_run++;
+            }
+        }
+    }
+}
+
+void sim_poll(void) {
+    static bool polling = false;
+    if (polling) {
+        // an interrupt handler is waiting on something
+        return;
+    }
+    polling = true;
+
+    uint64_t now = monotonic_ns();
+    uint64_t elapsed = now - last_poll;
+    last_poll = now;
+    if (elapsed > MAX_STEP_NS) {
+        elapsed = MAX_STEP_NS;
+    }
+    sim_time += elapsed;
+
+    service_rx(elapsed);
+    service_tx(elapsed);
+    service_timers(elapsed);
+
+    if (iwdg_running && !iwdg_warned && (sim_time - iwdg_last_reset) > (uint64_t)iwdg_period_ms * 1000000ULL) {
+        fprintf(stderr, "sim: watchdog not serviced for over %ums\n", iwdg_period_ms);
+        iwdg_warned = true;
+    }
+
+    bool tx_pending = sim_dma1[DMA_CHANNEL4].enabled && sim_dma1[DMA_CHANNEL4].count != 0;
+    if (config.input_eof && rx_queue_len == 0 && !tx_pending && (sim_time - eof_time) > 100000000ULL) {
+        // scripted input has been handled, leave time for any last response
+        exit(0);
+    }
+
+    if (rx_queue_len == 0 && !tx_pending) {
+        // nothing to do until the next byte or tick, avoid spinning a core
+        struct pollfd pfd = {.fd = config.in_fd, .events = POLLIN};
+        poll(&pfd, config.input_eof?0:1, 0);
+        struct timespec idle = {.tv_sec = 0, .tv_nsec = 20000};
+        nanosleep(&idle, NULL);
+    }
+
+    polling = false;
+}
+
+void sim_wait_for_interrupt(void) {
+    uint64_t count = interrupts_run;
+    while (interrupts_run == count) {
+        sim_poll();
+    }
+}
+
+/* rcc */
+void rcc_clock_setup_pll(const struct rcc_clock_scale* clock) {(void)clock;}
+void rcc_periph_clock_enable(enum rcc_periph_clken clken) {(void)clken;}
+void rcc_peripheral_enable_clock(volatile uint32_t* reg, uint32_t en) {*reg |= en;}
+void rcc_set_adcpre(uint32_t adcpre) {(void)adcpre;}
+
+/* gpio */
+void gpio_set_mode(uint32_t gpioport, uint8_t mode, uint8_t cnf, uint16_t gpios) {
+    (void)gpioport; (void)mode; (void)cnf; (void)gpios;
+}
+void gpio_set(uint32_t gpioport, uint16_t gpios) {sim_gpio_odr[gpioport] |= gpios;}
+void gpio_clear(uint32_t gpioport, uint16_t gpios) {sim_gpio_odr[gpioport] &= ~(uint32_t)gpios;}
+void gpio_toggle(uint32_t gpioport, uint16_t gpios) {sim_gpio_odr[gpioport] ^= gpios;}
+uint16_t gpio_get(uint32_t gpioport, uint16_t gpios) {
+    uint32_t level = sim_gpio_odr[gpioport];
+    if (gpioport == GPIOB) {
+        level &= ~(uint32_t)config.fault_pins;
+    }
+    return (uint16_t)(level & gpios);
+}
+
+/* usart */
+void usart_set_baudrate(uint32_t usart, uint32_t baud) {(void)usart; sim_usart1.baudrate = baud;}
+void usart_set_databits(uint32_t usart, uint32_t bits) {(void)usart; (void)bits;}
+void usart_set_stopbits(uint32_t usart, uint32_t stopbits) {(void)usart; (void)stopbits;}
+void usart_set_parity(uint32_t usart, uint32_t parity) {(void)usart; (void)parity;}
+void usart_set_flow_control(uint32_t usart, uint32_t flowcontrol) {(void)usart; (void)flowcontrol;}
+void usart_set_mode(uint32_t usart, uint32_t mode) {(void)usart; (void)mode;}
+void usart_enable(uint32_t usart) {
+    (void)usart;
+    sim_usart1.enabled = true;
+    usart_sr_modify(USART_SR_TC | USART_SR_TXE, 0);
+}
+void usart_disable(uint32_t usart) {(void)usart; sim_usart1.enabled = false;}
+uint16_t usart_recv(uint32_t usart) {
+    (void)usart;
+    // reading DR clears RXNE and the error flags
+    usart_sr_modify(0, USART_SR_RXNE | USART_SR_ORE | USART_SR_NE | USART_SR_FE | USART_SR_PE);
+    return (uint16_t)(sim_usart1.dr & 0x1ff);
+}
+void usart_send_blocking(uint32_t usart, uint16_t data) {
+    (void)usart;
+    uint8_t byte = (uint8_t)data;
+    write_out(&byte, 1);
+}
+void usart_enable_rx_interrupt(uint32_t usart) {(void)usart; sim_usart1.rx_interrupt = true;}
+void usart_disable_rx_interrupt(uint32_t usart) {(void)usart; sim_usart1.rx_interrupt = false;}
+void usart_enable_tx_dma(uint32_t usart) {(void)usart; sim_usart1.tx_dma = true;}
+void usart_disable_tx_dma(uint32_t usart) {(void)usart; sim_usart1.tx_dma = false;}
+bool usart_get_flag(uint32_t usart, uint32_t flag) {
+    (void)usart;
+    sr_sync(&sim_usart1.sr, &usart_sr_published, USART_SR_RC_W0);
+    return (sim_usart1.sr & flag) != 0;
+}
+
+/* timer */
+void timer_set_mode(uint32_t tim, uint32_t clock_div, uint32_t alignment, uint32_t direction) {
+    (void)tim; (void)clock_div; (void)alignment; (void)direction;
+}
+void timer_set_prescaler(uint32_t tim, uint32_t value) {sim_timers[tim].psc = value;}
+void timer_set_period(uint32_t tim, uint32_t period) {sim_timers[tim].arr = period;}
+void timer_set_oc_mode(uint32_t tim, enum tim_oc_id oc_id, uint32_t oc_mode) {sim_timers[tim].oc_mode[oc_id] = oc_mode;}
+void timer_set_oc_value(uint32_t tim, enum tim_oc_id oc_id, uint32_t value) {sim_timers[tim].ccr[oc_id] = value;}
+void timer_set_oc_polarity_high(uint32_t tim, enum tim_oc_id oc_id) {(void)tim; (void)oc_id;}
+void timer_enable_oc_preload(uint32_t tim, enum tim_oc_id oc_id) {(void)tim; (void)oc_id;}
+void timer_disable_oc_preload(uint32_t tim, enum tim_oc_id oc_id) {(void)tim; (void)oc_id;}
+void timer_enable_oc_output(uint32_t tim, enum tim_oc_id oc_id) {(void)tim; (void)oc_id;}
+void timer_set_master_mode(uint32_t tim, uint32_t mode) {sim_timers[tim].master_mode = mode;}
+void timer_enable_preload(uint32_t tim) {(void)tim;}
+void timer_enable_counter(uint32_t tim) {sim_timers[tim].enabled = true;}
+void timer_disable_counter(uint32_t tim) {sim_timers[tim].enabled = false;}
+void timer_set_counter(uint32_t tim, uint32_t count) {sim_timers[tim].cnt = count;}
+uint32_t timer_get_counter(uint32_t tim) {return sim_timers[tim].cnt;}
+void timer_generate_event(uint32_t tim, uint32_t event) {
+    if (event & TIM_EGR_UG) {
+        sim_timers[tim].cnt = 0;
+        sim_timers[tim].sr |= TIM_SR_UIF;
+    }
+}
+void timer_enable_irq(uint32_t tim, uint32_t irq) {sim_timers[tim].dier |= irq;}
+void timer_disable_irq(uint32_t tim, uint32_t irq) {sim_timers[tim].dier &= ~irq;}
+bool timer_get_flag(uint32_t tim, uint32_t flag) {return (sim_timers[tim].sr & flag) != 0;}
+void timer_clear_flag(uint32_t tim, uint32_t flag) {sim_timers[tim].sr &= ~flag;}
+
+/* adc */
+void adc_power_off(uint32_t adc) {(void)adc; sim_adc1.powered = false;}
+void adc_power_on(uint32_t adc) {(void)adc; sim_adc1.powered = true;}
+void adc_set_sample_time_on_all_channels(uint32_t adc, uint8_t time) {(void)adc; (void)time;}
+void adc_set_sample_time(uint32_t adc, uint8_t channel, uint8_t time) {(void)adc; (void)channel; (void)time;}
+void adc_set_right_aligned(uint32_t adc) {(void)adc;}
+void adc_enable_eoc_interrupt(uint32_t adc) {(void)adc; sim_adc1.eoc_interrupt = true;}
+void adc_disable_eoc_interrupt(uint32_t adc) {(void)adc; sim_adc1.eoc_interrupt = false;}
+void adc_enable_external_trigger_injected(uint32_t adc, uint32_t trigger) {(void)adc; sim_adc1.injected_trigger = trigger;}
+void adc_enable_scan_mode(uint32_t adc) {(void)adc;}
+void adc_set_injected_sequence(uint32_t adc, uint8_t length, uint8_t channel[]) {
+    (void)adc;
+    sim_adc1.injected_len = (length > 4)?4:length;
+    memcpy(sim_adc1.injected_seq, channel, sim_adc1.injected_len);
+}
+void adc_reset_calibration(uint32_t adc) {(void)adc;}
+void adc_calibrate(uint32_t adc) {(void)adc;}
+uint32_t adc_read_injected(uint32_t adc, uint8_t reg) {
+    (void)adc;
+    return (reg >= 1 && reg <= 4)?sim_adc1.jdr[reg - 1]:0;
+}
+void adc_enable_eoc_interrupt_injected(uint32_t adc) {(void)adc; sim_adc1.jeoc_interrupt = true;}
+void adc_disable_eoc_interrupt_injected(uint32_t adc) {(void)adc; sim_adc1.jeoc_interrupt = false;}
+void adc_set_regular_sequence(uint32_t adc, uint8_t length, uint8_t channel[]) {
+    (void)adc;
+    sim_adc1.regular_len = (length > 16)?16:length;
+    memcpy(sim_adc1.regular_seq, channel, sim_adc1.regular_len);
+}
+void adc_enable_external_trigger_regular(uint32_t adc, uint32_t trigger) {(void)adc; sim_adc1.regular_trigger = trigger;}
+void adc_start_conversion_regular(uint32_t adc) {
+    // Converts instantly, only the first channel of the sequence
+    (void)adc;
+    if (sim_adc1.powered && sim_adc1.regular_len != 0) {
+        sim_adc1.dr = channel_code(adc_last_sample, sim_adc1.regular_seq[0]);
+        adc_sr_modify(ADC_SR_EOC | ADC_SR_STRT, 0);
+    }
+}
+uint32_t adc_read_regular(uint32_t adc) {
+    (void)adc;
+    adc_sr_modify(0, ADC_SR_EOC);
+    return sim_adc1.dr;
+}
+void adc_enable_analog_watchdog_injected(uint32_t adc) {(void)adc; sim_adc1.awd_injected = true;}
+void adc_disable_analog_watchdog_injected(uint32_t adc) {(void)adc; sim_adc1.awd_injected = false;}
+void adc_enable_analog_watchdog_on_all_channels(uint32_t adc) {(void)adc;}
+void adc_set_watchdog_high_threshold(uint32_t adc, uint16_t threshold) {(void)adc; sim_adc1.awd_high = threshold;}
+void adc_set_watchdog_low_threshold(uint32_t adc, uint16_t threshold) {(void)adc; sim_adc1.awd_low = threshold;}
+void adc_enable_awd_interrupt(uint32_t adc) {(void)adc; sim_adc1.awd_interrupt = true;}
+void adc_disable_awd_interrupt(uint32_t adc) {(void)adc; sim_adc1.awd_interrupt = false;}
+
+/* iwdg */
+void iwdg_set_period_ms(uint32_t period) {iwdg_period_ms = period;}
+void iwdg_start(void) {iwdg_running = true; iwdg_last_reset = sim_time;}
+// The new period is taken straight away
+bool iwdg_prescaler_busy(void) {return false;}
+bool iwdg_reload_busy(void) {return false;}
+void iwdg_reset(void) {
+    iwdg_last_reset = sim_time;
+    sim_poll();
+}
+
+/* pwr */
+void pwr_disable_backup_domain_write_protect(void) {}
+void pwr_enable_backup_domain_write_protect(void) {}
+
+/* flash, only the configuration pages can be written */
+static uint8_t* flash_location(uint32_t address, size_t len) {
+    uint32_t start = (uint32_t)(uintptr_t)_config_start;
+    if (address < start || (address - start + len) > SIM_CONFIG_FLASH_SIZE) {
+        return NULL;
+    }
+    return &_config_start[address - start];
+}
+
+static void save_flash(void) {
+    if (config.flash_path == NULL) {
+        return;
+    }
+    FILE* f = fopen(config.flash_path, "wb");
+    if (f == NULL || fwrite(_config_start, 1, SIM_CONFIG_FLASH_SIZE, f) != SIM_CONFIG_FLASH_SIZE) {
+        perror(config.flash_path);
+    }
+    if (f != NULL) {
+        fclose(f);
+    }
+}
+
+void flash_unlock(void) {flash_locked = false;}
+void flash_lock(void) {
+    flash_locked = true;
+    save_flash();
+}
+void flash_erase_page(uint32_t page_address) {
+    uint8_t* page = flash_location(page_address, SIM_FLASH_PAGE_SIZE);
+    if (flash_locked || page == NULL || (page_address % SIM_FLASH_PAGE_SIZE) != 0) {
+        flash_sr |= FLASH_SR_WRPRTERR;
+        return;
+    }
+    memset(page, 0xFF, SIM_FLASH_PAGE_SIZE);
+    flash_sr |= FLASH_SR_EOP;
+}
+void flash_program_half_word(uint32_t address, uint16_t data) {
+    uint8_t* dest = flash_location(address, sizeof(data));
+    if (flash_locked || dest == NULL || (address & 1) != 0) {
+        flash_sr |= FLASH_SR_WRPRTERR;
+        return;
+    }
+    uint16_t current;
+    memcpy(&current, dest, sizeof(current));
+    // Half-words can only be programmed once after an erase, except to zero
+    if (current != 0xFFFF && data != 0) {
+        flash_sr |= FLASH_SR_PGERR;
+        return;
+    }
+    memcpy(dest, &data, sizeof(data));
+    flash_sr |= FLASH_SR_EOP;
+}
+uint32_t flash_get_status_flags(void) {return flash_sr;}
+void flash_clear_status_flags(void) {flash_sr = 0;}
+
+/* dma */
+void dma_channel_reset(uint32_t dma, uint8_t channel) {(void)dma; memset(&sim_dma1[channel], 0, sizeof(sim_dma1[channel]));}
+void dma_set_peripheral_address(uint32_t dma, uint8_t channel, uint32_t address) {(void)dma; sim_dma1[channel].peripheral_address = address;}
+void dma_set_memory_address(uint32_t dma, uint8_t channel, uint32_t address) {(void)dma; sim_dma1[channel].memory_address = address;}
+void dma_set_number_of_data(uint32_t dma, uint8_t channel, uint16_t number) {(void)dma; sim_dma1[channel].count = number;}
+void dma_set_read_from_memory(uint32_t dma, uint8_t channel) {(void)dma; (void)channel;}
+void dma_enable_memory_increment_mode(uint32_t dma, uint8_t channel) {(void)dma; (void)channel;}
+void dma_set_peripheral_size(uint32_t dma, uint8_t channel, uint32_t peripheral_size) {(void)dma; (void)channel; (void)peripheral_size;}
+void dma_set_memory_size(uint32_t dma, uint8_t channel, uint32_t mem_size) {(void)dma; (void)channel; (void)mem_size;}
+void dma_set_priority(uint32_t dma, uint8_t channel, uint32_t prio) {(void)dma; (void)channel; (void)prio;}
+void dma_enable_transfer_complete_interrupt(uint32_t dma, uint8_t channel) {(void)dma; sim_dma1[channel].tc_interrupt = true;}
+void dma_enable_channel(uint32_t dma, uint8_t channel) {(void)dma; sim_dma1[channel].enabled = true;}
+void dma_disable_channel(uint32_t dma, uint8_t channel) {(void)dma; sim_dma1[channel].enabled = false;}
+bool dma_get_interrupt_flag(uint32_t dma, uint8_t channel, uint32_t interrupts) {(void)dma; return (sim_dma1[channel].flags & interrupts) != 0;}
+void dma_clear_interrupt_flags(uint32_t dma, uint8_t channel, uint32_t interrupts) {(void)dma; sim_dma1[channel].flags &= ~interrupts;}
+
+/* nvic */
+void nvic_enable_irq(uint8_t irqn) {nvic_enabled[irqn / 32] |= (1u << (irqn % 32));}
+void nvic_disable_irq(uint8_t irqn) {nvic_enabled[irqn / 32] &= ~(1u << (irqn % 32));}
+uint8_t nvic_get_irq_enabled(uint8_t irqn) {return irq_enabled(irqn)?1:0;}
+void nvic_set_priority(uint8_t irqn, uint8_t priority) {(void)irqn; (void)priority;}
+
+/* dwt */
+bool dwt_enable_cycle_counter(void) {return true;}
+uint32_t dwt_read_cycle_counter(void) {
+    return (uint32_t)((monotonic_ns() * (SIM_CLOCK_HZ / 1000000)) / 1000);
+}
+
+/* systick */
+void systick_set_clocksource(uint8_t clocksource) {(void)clocksource;}
+void systick_set_reload(uint32_t value) {systick_reload = value;}
+void systick_clear(void) {systick_acc = 0;}
+void systick_interrupt_enable(void) {systick_irq = true;}
+void systick_counter_enable(void) {systick_running = true;}
+
+/* scb */
+void scb_reset_system(void) {
+    fprintf(stderr, "sim: system reset requested\n");
+    exit(0);
+}
+
+void sim_enter_bootloader(void) {
+    fprintf(stderr, "sim: entering bootloader\n");
+    exit(0);
+}
+
+#ifndef SIM_NO_MAIN
+// Tools such as bench_parse.c link the shims and provide their own main()
+
+static void load_adc_samples(const char* path) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+
+    size_t capacity = 0;
+    unsigned m0, m1, mv;
+    char line[128];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (line[0] == '#' || sscanf(line, "%u %u %u", &m0, &m1, &mv) != 3) {
+            continue;
+        }
+        if (adc_sample_count == capacity) {
+            capacity = (capacity == 0)?256:(capacity * 2);
+            adc_samples = realloc(adc_samples, capacity * sizeof(*adc_samples));
+        }
+        adc_samples[adc_sample_count++] = (adc_sample_t){
+            .m0_ma = (uint16_t)m0, .m1_ma = (uint16_t)m1, .voltage_mv = (uint16_t)mv};
+    }
+    fclose(f);
+}
+
+static void load_flash(const char* path) {
+    // A missing file starts with erased flash, it is created on the first write
+    config.flash_path = path;
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        if (errno != ENOENT) {
+            perror(path);
+            exit(1);
+        }
+        return;
+    }
+    if (fread(_config_start, 1, SIM_CONFIG_FLASH_SIZE, f) != SIM_CONFIG_FLASH_SIZE) {
+        fprintf(stderr, "sim: %s isn't a %u byte flash image\n", path, SIM_CONFIG_FLASH_SIZE);
+        exit(1);
+    }
+    fclose(f);
+}
+
+static void open_pty(const char* link_path) {
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+        perror("sim: unable to open pty");
+        exit(1);
+    }
+    const char* slave_name = ptsname(master);
+
+    // Raw mode on the slave so the host sees exactly what the firmware sends
+    int slave = open(slave_name, O_RDWR | O_NOCTTY);
+    struct termios tio;
+    if (slave >= 0 && tcgetattr(slave, &tio) == 0) {
+        cfmakeraw(&tio);
+        tcsetattr(slave, TCSANOW, &tio);
+    }
+    // slave is left open so the master doesn't see EIO between clients
+
+    if (link_path != NULL) {
+        unlink(link_path);
+        if (symlink(slave_name, link_path) != 0) {
+            perror("sim: unable to create pty link");
+            exit(1);
+        }
+    }
+    fprintf(stderr, "sim: serial port at %s\n", (link_path != NULL)?link_path:slave_name);
+
+    config.in_fd = master;
+    config.out_fd = master;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -p          serve the USART on a pty instead of stdin/stdout\n"
+        "  -l PATH     symlink the pty to PATH\n"
+        "  -b          pace serial data at the configured baud rate\n"
+        "  -a FILE     ADC samples, one '<M0 mA> <M1 mA> <12V mV>' line per scan\n"
+        "  -c M0,M1,MV constant ADC inputs (default 0,0,12000)\n"
+        "  -f MASK     GPIOB pins held low by a faulted H-bridge\n"
+        "  -s FILE     keep the configuration flash in FILE between runs\n",
+        name);
+}
+
+int main(int argc, char** argv) {
+    bool use_pty = false;
+    const char* link_path = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "pl:ba:c:f:s:h")) != -1) {
+        switch (opt) {
+            case 'p':
+                use_pty = true;
+                break;
+            case 'l':
+                link_path = optarg;
+                break;
+            case 'b':
+                config.pace = true;
+                break;
+            case 'a':
+                load_adc_samples(optarg);
+                break;
+            case 'c': {
+                unsigned m0, m1, mv;
+                if (sscanf(optarg, "%u,%u,%u", &m0, &m1, &mv) != 3) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                adc_constant = (adc_sample_t){.m0_ma = (uint16_t)m0, .m1_ma = (uint16_t)m1, .voltage_mv = (uint16_t)mv};
+                break;
+            }
+            case 'f':
+                config.fault_pins = (uint16_t)strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                load_flash(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h')?0:1;
+        }
+    }
+
+    if (use_pty) {
+        open_pty(link_path);
+    } else {
+        // stdin reaching EOF ends a scripted session
+        config.exit_on_eof = true;
+    }
+    fcntl(config.in_fd, F_SETFL, fcntl(config.in_fd, F_GETFL) | O_NONBLOCK);
+
+    last_poll = monotonic_ns();
+    return firmware_main();
+}
+#endif  // SIM_NO_MAIN
@@ -0,0 +1,300 @@
+#!/usr/bin/env python3
+"""
+Measure command latency and throughput of the motor board firmware.
+
+Runs against the host simulation (host/mcv4-sim) on a pseudo-terminal with
+serial pacing, or against a board when --port is given. Results are printed
+as JSON so runs of different firmware versions can be compared.
+"""
+import argparse
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import time
+from pathlib import Path
+
+import serial
+
+SIM_BINARY = (Path(__file__).parent / '../host/mcv4-sim').resolve()
+DEFAULT_BAUD = 115200
+# Commands the firmware queues before it stops reading, see "Pipelined Commands"
+QUEUE_LEN = 4
+
+# Representative command mixes, {power} alternates sign between commands
+MIXES = {
+    'set': ['MOT:0:SET:{power}', 'MOT:1:SET:{power}'],
+    'current': ['MOT:0:I?', 'MOT:1:I?'],
+    'status': ['*STATUS?'],
+    'control': ['MOT:0:SET:{power}', 'MOT:1:SET:{power}', 'MOT:0:I?', 'MOT:1:I?', '*STATUS?'],
+}
+
+
+class Board:
+    def __init__(self, port, timeout):
+        self.serial = serial.Serial(port, baudrate=DEFAULT_BAUD, timeout=timeout)
+        self.serial.reset_input_buffer()
+
+    def close(self):
+        self.serial.close()
+
+    def send(self, line):
+        self.serial.write(line.encode('ascii') + b'\n')
+
+    def read_line(self):
+        # Returns None on timeout
+        raw = self.serial.readline()
+        if not raw.endswith(b'\n'):
+            return None
+        return raw.decode('ascii', errors='replace').strip()
+
+    def command(self, line, data_lines=0):
+        self.send(line)
+        lines = [self.read_line() for _ in range(data_lines + 1)]
+        if None in lines:
+            raise RuntimeError(f"No response to {line!r}")
+        return lines
+
+    def set_baud(self, baud):
+        if self.command(f'*SYS:BAUD:{baud}')[-1] != 'ACK':
+            raise RuntimeError(f"Baud rate {baud} rejected")
+        self.serial.flush()
+        # The board switches once its ACK has been sent
+        time.sleep(0.02)
+        self.serial.baudrate = baud
+        for _ in range(3):
+            self.serial.reset_input_buffer()
+            self.send('*SYS:BAUD:CONFIRM')
+            if self.read_line() == 'ACK':
+                return
+        raise RuntimeError(f"Unable to confirm baud rate {baud}")
+
+
+def start_sim(sim, link, adc):
+    args = [str(sim), '-p', '-b', '-l', str(link), '-c', adc]
+    proc = subprocess.Popen(args, stderr=subprocess.DEVNULL)
+    deadline = time.monotonic() + 5
+    while not link.exists():
+        if proc.poll() is not None or time.monotonic() > deadline:
+            proc.kill()
+            raise RuntimeError(f"Simulation failed to start, has it been built with 'make host'?")
+        time.sleep(0.01)
+    return proc
+
+
+def mix_commands(mix, power):
+    # Endless cycle of the mix's commands
+    sign = 1
+    while True:
+        for template in MIXES[mix]:
+            yield template.format(power=sign * power)
+            sign = -sign
+
+
+def is_error(response):
+    return response is None or response.startswith('NACK')
+
+
+def summarise(latencies_ns):
+    if not latencies_ns:
+        return None
+    ordered = sorted(latencies_ns)
+
+    def percentile(p):
+        # nearest rank
+        rank = max(1, -(-len(ordered) * p // 100))
+        return ordered[rank - 1] / 1000
+
+    return {
+        'count': len(ordered),
+        'mean_us': sum(ordered) / len(ordered) / 1000,
+        'p50_us': percentile(50),
+        'p99_us': percentile(99),
+        'max_us': ordered[-1] / 1000,
+    }
+
+
+def measure_latency(board, mix, count, power):
+    # One command at a time, the round trip of each
+    latencies = []
+    errors = 0
+    commands = mix_commands(mix, power)
+    for _ in range(count):
+        line = next(commands)
+        start = time.perf_counter_ns()
+        board.send(line)
+        response = board.read_line()
+        end = time.perf_counter_ns()
+        if is_error(response):
+            errors += 1
+        else:
+            latencies.append(end - start)
+    return {'latency': summarise(latencies), 'errors': errors}
+
+
+def measure_throughput(board, mix, duration, window, power):
+    # Keeps window tagged commands in flight for the duration
+    commands = mix_commands(mix, power)
+    in_flight = {}
+    latencies = []
+    errors = 0
+    lost = 0
+    seq = 0
+    start = time.perf_counter_ns()
+    end = start + int(duration * 1e9)
+
+    while True:
+        now = time.perf_counter_ns()
+        while len(in_flight) < window and now < end:
+            seq = (seq + 1) % 100000
+            in_flight[seq] = now
+            board.send(f'@{seq}:{next(commands)}')
+        if not in_flight:
+            break
+
+        response = board.read_line()
+        received = time.perf_counter_ns()
+        if response is None:
+            # resynchronise, everything still in flight is lost
+            lost += len(in_flight)
+            in_flight.clear()
+            continue
+        tag, _, body = response.partition(':')
+        sent = in_flight.pop(int(tag[1:]), None) if tag[1:].isdigit() else None
+        if sent is None or is_error(body):
+            errors += 1
+        else:
+            latencies.append(received - sent)
+    elapsed = (time.perf_counter_ns() - start) / 1e9
+
+    return {
+        'window': window,
+        'commands_per_s': len(latencies) / elapsed,
+        'latency': summarise(latencies),
+        'errors': errors,
+        'lost': lost,
+    }
+
+
+def measure_flood(board, mix, count, power):
+    # Sends count tagged commands without waiting, then counts the outcomes
+    commands = mix_commands(mix, power)
+    board.serial.write(b''.join(f'@{seq}:{next(commands)}\n'.encode('ascii') for seq in range(count)))
+
+    answered = set()
+    nacks = {}
+    while True:
+        response = board.read_line()
+        if response is None:
+            break
+        tag, _, body = response.partition(':')
+        if tag[1:].isdigit():
+            answered.add(int(tag[1:]))
+        if body.startswith('NACK'):
+            nacks[body] = nacks.get(body, 0) + 1
+
+    return {
+        'sent': count,
+        'answered': len(answered),
+        'ok': len(answered) - sum(nacks.values()),
+        'nacks': nacks,
+    }
+
+
+def read_stats(board):
+    lines = board.command('*STATS?', data_lines=3)
+    timings = {}
+    for line in lines[:3]:
+        name, tmin, tmax, tmean, count = line.split(':')
+        timings[name] = {'min': int(tmin), 'max': int(tmax), 'mean': int(tmean), 'count': int(count)}
+    adc_overruns, usart_errors, idle = lines[3].split(':')
+    return {
+        'timings_cycles': timings,
+        'adc_overruns': int(adc_overruns),
+        'usart_errors': [int(v) for v in usart_errors.split(',')],
+        'idle_percent': int(idle),
+    }
+
+
+def run(board, args):
+    results = {
+        'target': 'hardware' if args.port else 'simulation',
+        'identity': board.command('*IDN?')[0],
+        'baud': args.baud,
+        'mixes': {},
+    }
+    board.command('*RESET')
+    if args.baud != DEFAULT_BAUD:
+        board.set_baud(args.baud)
+    board.command('*STATS:RESET')
+
+    for mix in args.mix:
+        print(f"Running {mix}", file=sys.stderr)
+        results['mixes'][mix] = {
+            'sequential': measure_latency(board, mix, args.count, args.power),
+            'pipelined': measure_throughput(board, mix, args.duration, args.window, args.power),
+            'flood': measure_flood(board, mix, args.flood, args.power),
+        }
+
+    results['firmware_stats'] = read_stats(board)
+    # Stops the motors and returns to the default baud rate
+    board.command('*RESET')
+    return results
+
+
+def print_summary(results):
+    for mix, result in results['mixes'].items():
+        seq = result['sequential']['latency'] or {}
+        pipe = result['pipelined']
+        flood = result['flood']
+        print(
+            f"{mix:8} p50 {seq.get('p50_us', 0):8.1f}us  p99 {seq.get('p99_us', 0):8.1f}us  "
+            f"{pipe['commands_per_s']:7.0f} cmd/s  flood {flood['ok']}/{flood['sent']} ok",
+            file=sys.stderr)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--port', default=None, help="Serial port of a board, defaults to running the simulation")
+    parser.add_argument('--sim', default=SIM_BINARY, type=Path, help="Simulation executable")
+    parser.add_argument('--sim-adc', default='1500,1500,12000', help="Simulated ADC inputs, <M0 mA>,<M1 mA>,<12V mV>")
+    parser.add_argument('--baud', default=DEFAULT_BAUD, type=int, help="Baud rate to switch to with *SYS:BAUD")
+    parser.add_argument('--mix', action='append', choices=MIXES.keys(), help="Command mixes to run, defaults to all")
+    parser.add_argument('--count', default=500, type=int, help="Round trips per mix for the sequential latency")
+    parser.add_argument('--duration', default=2.0, type=float, help="Seconds per mix for the pipelined throughput")
+    parser.add_argument('--window', default=QUEUE_LEN, type=int, help="Pipelined commands kept in flight")
+    parser.add_argument('--flood', default=64, type=int, help="Commands sent back to back in the flood test")
+    parser.add_argument('--power', default=0, type=int, help="Motor power used by MOT:n:SET, 0 keeps real motors still")
+    parser.add_argument('--timeout', default=0.5, type=float, help="Seconds to wait for a response")
+    parser.add_argument('-o', '--output', default=None, help="Write the JSON results to this file instead of stdout")
+    args = parser.parse_args()
+    args.mix = args.mix or list(MIXES.keys())
+
+    with tempfile.TemporaryDirectory() as tmpdirname:
+        sim = None
+        port = args.port
+        if port is None:
+            port = Path(tmpdirname) / 'tty'
+            sim = start_sim(args.sim, port, args.sim_adc)
+        try:
+            board = Board(str(port), args.timeout)
+            try:
+                results = run(board, args)
+            finally:
+                board.close()
+        finally:
+            if sim is not None:
+                sim.terminate()
+                sim.wait()
+
+    print_summary(results)
+    output = json.dumps(results, indent=2)
+    if args.output is None:
+        print(output)
+    else:
+        Path(args.output).write_text(output + '\n')
+
+
+if __name__ == '__main__':
+    main()
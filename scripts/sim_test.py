@@ -0,0 +1,66 @@
+#!/usr/bin/env python3
+"""
+Behavioural tests of the firmware against the host simulation.
+
+Each test starts host/mcv4-sim on a pseudo-terminal with serial pacing and
+talks to it like a board, build the simulation first with 'make host'.
+"""
+import tempfile
+import time
+import unittest
+from pathlib import Path
+
+from benchmark import Board, SIM_BINARY, start_sim
+
+# Commands the firmware queues before it stops reading, see "Pipelined Commands"
+QUEUE_LEN = 4
+
+
+class SimTestCase(unittest.TestCase):
+    sim_adc = '1500,1500,12000'
+
+    def setUp(self):
+        self.tmpdir = tempfile.TemporaryDirectory()
+        port = Path(self.tmpdir.name) / 'tty'
+        self.sim = start_sim(SIM_BINARY, port, self.sim_adc)
+        self.board = Board(str(port), timeout=0.5)
+
+    def tearDown(self):
+        self.board.close()
+        self.sim.terminate()
+        self.sim.wait()
+        self.tmpdir.cleanup()
+
+    def command(self, line, data_lines=0):
+        # The response, after any data lines
+        return self.board.command(line, data_lines)[-1]
+
+
+class PipelineTest(SimTestCase):
+    def test_more_than_queue_length(self):
+        # The lines past the queue wait in the receive buffer
+        count = QUEUE_LEN * 3
+        self.board.serial.write(b''.join(f'@{seq}:MOT:0:GET?\n'.encode('ascii') for seq in range(count)))
+        responses = [self.board.read_line() for _ in range(count)]
+        self.assertEqual(responses, [f'@{seq}:0:0' for seq in range(count)])
+        # <overrun>,<framing>,<noise>,<receive buffer full>
+        self.assertEqual(self.command('*STATS?', data_lines=3).split(':')[1], '0,0,0,0')
+
+
+class TrajectoryTest(SimTestCase):
+    def test_manual_setpoint_stops_playback(self):
+        # The second entry would otherwise overwrite the manual setpoint
+        self.assertEqual(self.command('TRAJ:ADD:0:0:200:300000:0:-200'), 'ACK')
+        self.assertEqual(self.command('TRAJ:START'), 'ACK')
+        self.assertEqual(self.command('MOT:0:SET:500'), 'ACK')
+        self.assertEqual(self.command('TRAJ?').split(':')[:3], ['DONE', '1', '0'])
+        time.sleep(0.4)
+        self.assertEqual(self.command('MOT:0:GET?'), '1:500')
+        # A late refill is refused until the trajectory is aborted
+        self.assertEqual(self.command('TRAJ:ADD:400000:0:100'), 'NACK:Trajectory done')
+        self.assertEqual(self.command('TRAJ:ABORT'), 'ACK')
+        self.assertEqual(self.command('TRAJ?').split(':')[0], 'IDLE')
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -1,6 +1,13 @@
 #include "analogue.h"
 #include "led.h"
 #include "output.h"
+#include "capture.h"
+#include "torque.h"
+#include "stats.h"
+#include "eventlog.h"
+#include "energy.h"
+#include "ilimit.h"
+#include "config.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,9 +20,28 @@
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/stm32/timer.h>
 #include <libopencm3/stm32/dbgmcu.h>
+#include <libopencm3/cm3/cortex.h>
+
+// 2*pi in Q16
+#define TWO_PI_Q16 411775
+// Logged once the input falls below this, cleared above UNDERVOLTAGE_CLEAR_MV
+#define UNDERVOLTAGE_MV 10500
+#define UNDERVOLTAGE_CLEAR_MV 11000
+
+typedef struct {
+    uint32_t state[CURRENT_FILTER_MAX_STAGES];  // mA in Q16
+    uint32_t alpha;  // Q16, 0 bypasses the filter
+    uint8_t stages;
+    uint16_t cutoff_hz;
+} current_filter_t;
 
 uint16_t input_voltage = 0;
 
+static current_filter_t filters[NUM_OUTPUTS];
+static bool synced_to_pwm = false;
+static volatile uint32_t sample_count = 0;
+static bool undervoltage = false;
+
 static void init_adc_timer(void) {
     rcc_periph_clock_enable(RCC_TIM1);
 
@@ -38,6 +64,24 @@ static void init_adc_timer(void) {
     DBGMCU_CR |= DBGMCU_CR_TIM1_STOP;
 }
 
+static void power_up_adc(void) {
+    adc_power_on(ADC1);
+
+    // Wait >1.3us for ADC to be ready to perform conversions
+    __asm__(  // wait 40 clock cycles @ 24MHz = ~1.6us
+        "nop;nop;nop;nop;nop;"
+        "nop;nop;nop;nop;nop;"  // 10
+        "nop;nop;nop;nop;nop;"
+        "nop;nop;nop;nop;nop;"  // 20
+        "nop;nop;nop;nop;nop;"
+        "nop;nop;nop;nop;nop;"  // 30
+        "nop;nop;nop;nop;nop;"
+        "nop;nop;nop;nop;nop;"  // 40
+    );
+    adc_reset_calibration(ADC1);
+    adc_calibrate(ADC1);
+}
+
 static void init_adc(void) {
     gpio_set_mode(GPIOB, GPIO_MODE_INPUT, GPIO_CNF_INPUT_ANALOG, GPIO1);  // 12V
     gpio_set_mode(GPIOC, GPIO_MODE_INPUT, GPIO_CNF_INPUT_ANALOG, GPIO3);  // M0 CS
@@ -53,10 +97,11 @@ static void init_adc(void) {
     adc_set_sample_time_on_all_channels(ADC1, ADC_SMPR_SMP_239DOT5CYC);
     adc_set_right_aligned(ADC1);
 
-    // Enable an interrupt after each scan run
+    // Enable an interrupt after each scan run, the regular 12V conversion
+    // doesn't interrupt
     nvic_enable_irq(NVIC_ADC1_2_IRQ);
     nvic_set_priority(NVIC_ADC1_2_IRQ, 1);
-    adc_enable_eoc_interrupt(ADC1);
+    adc_enable_eoc_interrupt_injected(ADC1);
 
     // Enable scan runs on timer 1 trigger output
     adc_enable_external_trigger_injected(ADC1, ADC_CR2_JEXTSEL_TIM1_TRGO);
@@ -64,28 +109,146 @@ static void init_adc(void) {
 
     // Configure the channels to be sampled in each scan run
     // the outputs will be in the ADC_JDRx registers
-    uint8_t channel[] = {9, 13, 10};
-    adc_set_injected_sequence(ADC1, 3, channel);
+    // Only the currents are injected so the analog watchdog can guard
+    // them without the 12V reading tripping it
+    uint8_t channel[] = {13, 10};
+    adc_set_injected_sequence(ADC1, 2, channel);
 
-    adc_power_on(ADC1);
+    // The 12V input is converted after each scan, started from the interrupt
+    uint8_t regular_channel[] = {9};
+    adc_set_regular_sequence(ADC1, 1, regular_channel);
+    adc_enable_external_trigger_regular(ADC1, ADC_CR2_EXTSEL_SWSTART);
 
-    // Wait >1.3us for ADC to be ready to perform conversions
-    __asm__(  // wait 40 clock cycles @ 24MHz = ~1.6us
-        "nop;nop;nop;nop;nop;"
-        "nop;nop;nop;nop;nop;"  // 10
-        "nop;nop;nop;nop;nop;"
-        "nop;nop;nop;nop;nop;"  // 20
-        "nop;nop;nop;nop;nop;"
-        "nop;nop;nop;nop;nop;"  // 30
-        "nop;nop;nop;nop;nop;"
-        "nop;nop;nop;nop;nop;"  // 40
-    );
-    adc_reset_calibration(ADC1);
-    adc_calibrate(ADC1);
+    // The watchdog is enabled once a current limit is set
+    adc_enable_analog_watchdog_on_all_channels(ADC1);
+    adc_set_watchdog_low_threshold(ADC1, 0);
+
+    power_up_adc();
+    // so the first scan has a 12V reading
+    adc_start_conversion_regular(ADC1);
+}
+
+static void set_trigger(bool synced) {
+    // The ADC is powered down so the trigger can't fire mid-change
+    adc_power_off(ADC1);
+    if (synced) {
+        timer_disable_counter(TIM1);
+        // The scan has to fit well inside the shortest PWM period,
+        // 2 channels of 28.5 + 12.5 cycles at 12MHz take ~7us
+        adc_set_sample_time_on_all_channels(ADC1, ADC_SMPR_SMP_28DOT5CYC);
+        adc_enable_external_trigger_injected(ADC1, ADC_CR2_JEXTSEL_TIM2_TRGO);
+    } else {
+        adc_set_sample_time_on_all_channels(ADC1, ADC_SMPR_SMP_239DOT5CYC);
+        adc_enable_external_trigger_injected(ADC1, ADC_CR2_JEXTSEL_TIM1_TRGO);
+    }
+    power_up_adc();
+    if (!synced) {
+        timer_enable_counter(TIM1);
+    }
+
+    synced_to_pwm = synced;
+    analogue_update_filters();
+}
+
+void analogue_sync_to_pwm(uint16_t phase) {
+    output_set_trigger_phase(phase);
+    if (!synced_to_pwm) {
+        set_trigger(true);
+    }
+}
+
+void analogue_free_run(void) {
+    if (synced_to_pwm) {
+        set_trigger(false);
+    }
+}
+
+bool analogue_synced(void) {
+    return synced_to_pwm;
+}
+
+uint32_t analogue_sample_count(void) {
+    // Scans handled since power on, wraps
+    return sample_count;
+}
+
+uint32_t analogue_sample_rate(void) {
+    if (synced_to_pwm) {
+        // One scan per PWM period
+        return output_get_pwm_rate();
+    }
+    // Each TIM1 period triggers one scan
+    return 24000000 / ((TIM_PSC(TIM1) + 1) * (TIM_ARR(TIM1) + 1));
+}
+
+static uint32_t filter_alpha(uint16_t cutoff_hz) {
+    // Single pole low-pass, alpha = w/(1 + w) with w = 2*pi*fc/fs
+    // This stays below 1 and is close to 1 - exp(-w) for fc well below fs
+    if (cutoff_hz == 0) {
+        return 0;
+    }
+    uint32_t w = (uint32_t)(((uint64_t)TWO_PI_Q16 * cutoff_hz) / analogue_sample_rate());
+    return (uint32_t)(((uint64_t)w << 16) / (65536 + w));
+}
+
+void analogue_set_filter(uint8_t output_num, uint16_t cutoff_hz, uint8_t stages) {
+    if (!(output_num < NUM_OUTPUTS)) {
+        // skip invalid output numbers
+        return;
+    }
+    if (cutoff_hz > CURRENT_FILTER_MAX_CUTOFF) {
+        cutoff_hz = CURRENT_FILTER_MAX_CUTOFF;
+    }
+    if (stages < 1) {
+        stages = 1;
+    } else if (stages > CURRENT_FILTER_MAX_STAGES) {
+        stages = CURRENT_FILTER_MAX_STAGES;
+    }
+    uint32_t alpha = filter_alpha(cutoff_hz);
+
+    current_filter_t* filter = &filters[output_num];
+    CM_ATOMIC_BLOCK() {
+        // Added stages start from the current output so the reading doesn't jump
+        for (uint8_t i = filter->stages; i < stages; i++) {
+            filter->state[i] = filter->state[filter->stages - 1];
+        }
+        filter->alpha = alpha;
+        filter->stages = stages;
+        filter->cutoff_hz = cutoff_hz;
+    }
+}
+
+void analogue_update_filters(void) {
+    // Recalculate the coefficients for a new sample rate
+    for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+        analogue_set_filter(i, filters[i].cutoff_hz, filters[i].stages);
+    }
+    energy_set_sample_rate(analogue_sample_rate());
+}
+
+uint16_t analogue_get_filter_cutoff(uint8_t output_num) {
+    if (!(output_num < NUM_OUTPUTS)) {
+        // skip invalid output numbers
+        return 0;
+    }
+    return filters[output_num].cutoff_hz;
+}
+
+uint8_t analogue_get_filter_stages(uint8_t output_num) {
+    if (!(output_num < NUM_OUTPUTS)) {
+        // skip invalid output numbers
+        return 0;
+    }
+    return filters[output_num].stages;
 }
 
 void analogue_init(void) {
     init_adc_timer();
+    for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+        filters[i].stages = 1;  // so the first stage is the one copied from
+        analogue_set_filter(i, (uint16_t)config_get(CONFIG_FILTER_CUTOFF), (uint8_t)config_get(CONFIG_FILTER_STAGES));
+    }
+    energy_set_sample_rate(analogue_sample_rate());
     init_adc();
 
     timer_enable_counter(TIM1);
@@ -95,43 +258,121 @@ static uint16_t convert_to_ma(uint16_t current_raw) {
     // voltage_mv = code * vref/4096
     // current_ma = (voltage_mv/rshunt) * Igain
 
-    // current_ma = code * 3300/(4096 * 1100) * 7000
-    return (uint16_t)((((uint32_t)current_raw * 2625) >> 9) & 0xffff);
+    // current_ma = code * 3300/(4096 * 1100) * 7000, calibrated by the scale
+    return (uint16_t)((((uint32_t)current_raw * (uint32_t)config_get(CONFIG_CURRENT_SCALE)) >> 9) & 0xffff);
 }
 
-static uint16_t convert_to_mv(uint16_t voltage_raw) {
-    // meas_voltage_mv = code * vref/4096
-    // voltage_mv = meas_voltage_mv * (R1 + R2)/(R2)
+uint16_t analogue_raw_to_ma(uint16_t current_raw) {
+    return convert_to_ma(current_raw);
+}
 
-    // voltage_mv = (code * 3300/4096) * 5400/1100
-    return (uint16_t)((((uint32_t)voltage_raw * 2025) >> 9) & 0xffff);
+void analogue_set_current_watchdog(uint16_t threshold_raw) {
+    // Interrupts on any current conversion above the threshold
+    CM_ATOMIC_BLOCK() {
+        if (threshold_raw > 0xfff) {
+            adc_disable_awd_interrupt(ADC1);
+            adc_disable_analog_watchdog_injected(ADC1);
+        } else {
+            adc_set_watchdog_high_threshold(ADC1, threshold_raw);
+            adc_enable_analog_watchdog_injected(ADC1);
+            adc_enable_awd_interrupt(ADC1);
+        }
+    }
 }
 
-static uint16_t decay_filter(uint16_t in_sample, uint16_t prev_out_sample) {
-    // Low-pass single-pole IIR filter, decay=0.972
-    // y(n) = b1*x[n] + a0*y[n-1], a0 = decay, b1 = (1 - a0)
-    int32_t decay = 256 - 249;  // 1 - 0.972 shifted 8 left
-    int32_t intermediary = ((int32_t)in_sample - (int32_t)prev_out_sample);
-    return (uint16_t)(prev_out_sample + ((decay * intermediary) >> 8));
+uint16_t analogue_ma_to_raw(uint16_t current_ma) {
+    // Inverse of convert_to_ma, rounded up so thresholds aren't crossed early
+    uint32_t scale = (uint32_t)config_get(CONFIG_CURRENT_SCALE);
+    uint32_t raw = (((uint32_t)current_ma << 9) + scale - 1) / scale;
+    return (raw > 0xfff)?(0xfff):((uint16_t)raw);
 }
 
-void adc1_2_isr(void) {
-    ADC1_SR = 0;
-    check_output_faults();
+static uint16_t convert_to_mv(uint16_t voltage_raw) {
+    // meas_voltage_mv = code * vref/4096
+    // voltage_mv = meas_voltage_mv * (R1 + R2)/(R2)
 
-    input_voltage = convert_to_mv(adc_read_injected(ADC1, 1));  // 12V
-    uint16_t m0_current = convert_to_ma((uint16_t)(adc_read_injected(ADC1, 2) & 0xffff));  // M0 CS
-    uint16_t m1_current = convert_to_ma((uint16_t)(adc_read_injected(ADC1, 3) & 0xffff));  // M1 CS
+    // voltage_mv = (code * 3300/4096) * 5400/1100, calibrated by the scale
+    return (uint16_t)((((uint32_t)voltage_raw * (uint32_t)config_get(CONFIG_VOLTAGE_SCALE)) >> 9) & 0xffff);
+}
 
-    output_data[0].current = decay_filter(m0_current, output_data[0].current);
-    output_data[1].current = decay_filter(m1_current, output_data[1].current);
+static uint16_t filter_current(current_filter_t* filter, uint16_t current_ma) {
+    // Cascaded single pole IIR stages, y[n] = y[n-1] + alpha*(x[n] - y[n-1])
+    // The Q16 state keeps the fraction that a 16 bit state would round away
+    uint32_t sample = (uint32_t)current_ma << 16;
+    if (filter->alpha == 0) {
+        filter->state[0] = sample;
+        return current_ma;
+    }
+    for (uint8_t i = 0; i < filter->stages; i++) {
+        int32_t diff = (int32_t)(sample - filter->state[i]);
+        filter->state[i] += (uint32_t)(((int64_t)diff * filter->alpha) >> 16);
+        sample = filter->state[i];
+    }
+    // round to the nearest mA
+    return (uint16_t)((sample + 0x8000) >> 16);
+}
 
-    // Light blue LEDs when the outputs are drawing more than 5 amps
+void analogue_monitor(void) {
+    // Light blue LEDs when the outputs are drawing more than 5 amps, by default
+    int32_t led_current = config_get(CONFIG_LED_CURRENT);
     for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
-        if (output_data[i].current > 5000) {
+        if (output_data[i].current > led_current) {
             led_set((i == 0)?(LED_M0_B):(LED_M1_B));
         } else {
             led_clear((i == 0)?(LED_M0_B):(LED_M1_B));
         }
     }
+
+    uint16_t voltage = input_voltage;
+    if (!undervoltage && voltage < UNDERVOLTAGE_MV) {
+        undervoltage = true;
+        eventlog_record(EVENT_UNDERVOLTAGE, 0, voltage);
+    } else if (undervoltage && voltage > UNDERVOLTAGE_CLEAR_MV) {
+        undervoltage = false;
+        eventlog_record(EVENT_VOLTAGE_OK, 0, voltage);
+    }
+}
+
+void adc1_2_isr(void) {
+    uint32_t start = stats_cycles();
+    uint32_t status = ADC1_SR;
+    // The flags are cleared by writing 0, only clear the ones handled here.
+    // A read-modify-write would also clear any that set since the read.
+    ADC1_SR = ~status;
+
+    uint16_t m0_raw = (uint16_t)(adc_read_injected(ADC1, 1) & 0xffff);  // M0 CS
+    uint16_t m1_raw = (uint16_t)(adc_read_injected(ADC1, 2) & 0xffff);  // M1 CS
+
+    if (status & ADC_SR_AWD) {
+        // A current is over the lowest limit, this can be part way through the scan
+        ilimit_watchdog(m0_raw, m1_raw);
+    }
+    if (!(status & ADC_SR_JEOC)) {
+        return;
+    }
+
+    // Converted after the previous scan
+    uint16_t voltage_raw = (uint16_t)(adc_read_regular(ADC1) & 0xffff);  // 12V
+    adc_start_conversion_regular(ADC1);
+
+    capture_sample(m0_raw, m1_raw, voltage_raw);
+
+    input_voltage = convert_to_mv(voltage_raw);
+    uint16_t m0_current = convert_to_ma(m0_raw);
+    uint16_t m1_current = convert_to_ma(m1_raw);
+
+    torque_update(m0_current, m1_current);
+    energy_update(m0_current, m1_current, input_voltage);
+
+    output_data[0].current = filter_current(&filters[0], m0_current);
+    output_data[1].current = filter_current(&filters[1], m1_current);
+    ilimit_scan_done();
+
+    sample_count++;
+
+    // The next scan already finished, so one was nearly or actually missed
+    if (ADC1_SR & ADC_SR_JEOC) {
+        stats_adc_overrun();
+    }
+    stats_record(STATS_ADC_ISR, start);
 }
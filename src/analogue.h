@@ -1,7 +1,33 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
+
+#define CURRENT_FILTER_MAX_CUTOFF 2000  // Hz
+#define CURRENT_FILTER_MAX_STAGES 2
+// Threshold that disables the current watchdog
+#define ANALOGUE_WATCHDOG_OFF 0xffff
 
 extern uint16_t input_voltage;
 
 void analogue_init(void);
+uint16_t analogue_ma_to_raw(uint16_t current_ma);
+uint16_t analogue_raw_to_ma(uint16_t current_raw);
+// Interrupts when either current is above the threshold, in ADC codes
+void analogue_set_current_watchdog(uint16_t threshold_raw);
+uint32_t analogue_sample_rate(void);
+uint32_t analogue_sample_count(void);
+// Current LEDs and undervoltage logging, run by the scheduler
+void analogue_monitor(void);
+
+// Scan at a point in each PWM period, in 1/1000ths of the period, or from TIM1
+void analogue_sync_to_pwm(uint16_t phase);
+void analogue_free_run(void);
+bool analogue_synced(void);
+
+// A cutoff of 0 reports the unfiltered current
+void analogue_set_filter(uint8_t output_num, uint16_t cutoff_hz, uint8_t stages);
+uint16_t analogue_get_filter_cutoff(uint8_t output_num);
+uint8_t analogue_get_filter_stages(uint8_t output_num);
+// Must be called when the sample rate changes
+void analogue_update_filters(void);
@@ -0,0 +1,329 @@
+#include "bin_handler.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "output.h"
+#include "analogue.h"
+#include "usart.h"
+#include "clock.h"
+#include "telemetry.h"
+#include "torque.h"
+#include "ramp.h"
+#include "traj.h"
+
+// Largest decoded frame is opcode + SET_ALL payload + crc
+#define FRAME_MAXLEN 16
+// COBS adds at most one byte per 254 for frames this short
+#define ENCODED_MAXLEN (FRAME_MAXLEN + 2)
+
+static bool bin_mode = false;
+static uint32_t last_frame_time = 0;
+
+static uint8_t frame_buffer[ENCODED_MAXLEN];
+static uint8_t frame_len = 0;
+static bool frame_overflow = false;
+
+static uint16_t crc16(const uint8_t* data, uint8_t len) {
+    // CRC-16/CCITT-FALSE, computed bitwise to save ROM
+    uint16_t crc = 0xFFFF;
+    for (uint8_t i = 0; i < len; i++) {
+        crc ^= (uint16_t)data[i] << 8;
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            if (crc & 0x8000) {
+                crc = (crc << 1) ^ 0x1021;
+            } else {
+                crc <<= 1;
+            }
+        }
+    }
+    return crc;
+}
+
+static uint8_t cobs_decode(uint8_t* buf, uint8_t len) {
+    // Decode in place, returns 0 for a malformed frame
+    uint8_t in = 0;
+    uint8_t out = 0;
+    while (in < len) {
+        uint8_t code = buf[in++];
+        if (code == 0 || (in + code - 1) > len) {
+            return 0;
+        }
+        for (uint8_t i = 1; i < code; i++) {
+            buf[out++] = buf[in++];
+        }
+        if (code != 0xFF && in < len) {
+            buf[out++] = 0;
+        }
+    }
+    return out;
+}
+
+static uint8_t cobs_encode(const uint8_t* src, uint8_t len, uint8_t* dest) {
+    // dest must fit len + 2 bytes, including the trailing delimiter
+    uint8_t code_idx = 0;
+    uint8_t out = 1;
+    uint8_t code = 1;
+    for (uint8_t i = 0; i < len; i++) {
+        if (src[i] == 0) {
+            dest[code_idx] = code;
+            code_idx = out++;
+            code = 1;
+        } else {
+            dest[out++] = src[i];
+            code++;
+        }
+    }
+    dest[code_idx] = code;
+    dest[out++] = 0;
+    return out;
+}
+
+static inline uint16_t read_u16(const uint8_t* p) {
+    return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
+}
+
+static inline int16_t read_i16(const uint8_t* p) {
+    return (int16_t)read_u16(p);
+}
+
+static inline void write_u16(uint8_t* p, uint16_t val) {
+    p[0] = (uint8_t)(val & 0xff);
+    p[1] = (uint8_t)(val >> 8);
+}
+
+static void send_frame(uint8_t* frame, uint8_t len) {
+    // frame must have 2 spare bytes for the crc
+    uint8_t encoded[FRAME_MAXLEN + 2];
+    write_u16(&frame[len], crc16(frame, len));
+    len += 2;
+    usart_send(encoded, cobs_encode(frame, len, encoded));
+}
+
+static void send_nack(uint8_t opcode, uint8_t err) {
+    uint8_t reply[5] = {BIN_OP_NACK, opcode, err};
+    send_frame(reply, 3);
+}
+
+static uint8_t fault_bitmask(void) {
+    uint8_t faults = 0;
+    for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+        if (output_data[i].in_fault) {
+            faults |= (1 << i);
+        }
+    }
+    return faults;
+}
+
+static void handle_frame(const uint8_t* frame, uint8_t len) {
+    uint8_t opcode = frame[0];
+    const uint8_t* payload = &frame[1];
+    uint8_t payload_len = len - 1;
+    uint8_t reply[FRAME_MAXLEN];
+    uint8_t reply_len = 1;
+
+    reply[0] = opcode | BIN_REPLY_FLAG;
+
+    switch (opcode) {
+        case BIN_OP_SET: {
+            if (payload_len != 3) {
+                send_nack(opcode, BIN_ERR_LENGTH);
+                return;
+            }
+            int16_t output_val = read_i16(&payload[1]);
+            if (payload[0] >= NUM_OUTPUTS || output_val < MIN_MOTOR_VAL || output_val > MAX_MOTOR_VAL) {
+                send_nack(opcode, BIN_ERR_ARGUMENT);
+                return;
+            }
+            traj_stop();
+            torque_release(payload[0]);
+            ramp_set_target(payload[0], output_val);
+            break;
+        }
+        case BIN_OP_SET_ALL: {
+            if (payload_len != (2 * NUM_OUTPUTS)) {
+                send_nack(opcode, BIN_ERR_LENGTH);
+                return;
+            }
+            // validate every value before changing any output
+            for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+                int16_t output_val = read_i16(&payload[2 * i]);
+                if (output_val < MIN_MOTOR_VAL || output_val > MAX_MOTOR_VAL) {
+                    send_nack(opcode, BIN_ERR_ARGUMENT);
+                    return;
+                }
+            }
+            traj_stop();
+            for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+                torque_release(i);
+                ramp_stage_target(i, read_i16(&payload[2 * i]));
+            }
+            output_commit();
+            break;
+        }
+        case BIN_OP_GET:
+            if (payload_len != 1) {
+                send_nack(opcode, BIN_ERR_LENGTH);
+                return;
+            }
+            if (payload[0] >= NUM_OUTPUTS) {
+                send_nack(opcode, BIN_ERR_ARGUMENT);
+                return;
+            }
+            reply[1] = output_enabled(payload[0])?1:0;
+            write_u16(&reply[2], (uint16_t)output_get_output(payload[0]));
+            write_u16(&reply[4], output_get_current(payload[0]));
+            reply_len = 6;
+            break;
+        case BIN_OP_DISABLE:
+            if (payload_len != 1) {
+                send_nack(opcode, BIN_ERR_LENGTH);
+                return;
+            }
+            if (payload[0] == 0xFF) {
+                traj_stop();
+                for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+                    torque_release(i);
+                    ramp_stop(i);
+                    output_disable(i);
+                }
+            } else if (payload[0] < NUM_OUTPUTS) {
+                traj_stop();
+                torque_release(payload[0]);
+                ramp_stop(payload[0]);
+                output_disable(payload[0]);
+            } else {
+                send_nack(opcode, BIN_ERR_ARGUMENT);
+                return;
+            }
+            break;
+        case BIN_OP_STATUS:
+            if (payload_len != 0) {
+                send_nack(opcode, BIN_ERR_LENGTH);
+                return;
+            }
+            reply[1] = fault_bitmask();
+            write_u16(&reply[2], input_voltage);
+            reply_len = 4;
+            break;
+        case BIN_OP_TELEMETRY: {
+            if (payload_len != 2) {
+                send_nack(opcode, BIN_ERR_LENGTH);
+                return;
+            }
+            uint16_t rate = read_u16(payload);
+            if (rate > TELEMETRY_MAX_RATE) {
+                send_nack(opcode, BIN_ERR_ARGUMENT);
+                return;
+            }
+            telemetry_set_rate(rate);
+            break;
+        }
+        case BIN_OP_SET_CURRENT: {
+            if (payload_len != 3) {
+                send_nack(opcode, BIN_ERR_LENGTH);
+                return;
+            }
+            int16_t target = read_i16(&payload[1]);
+            if (payload[0] >= NUM_OUTPUTS || target < -TORQUE_MAX_CURRENT || target > TORQUE_MAX_CURRENT) {
+                send_nack(opcode, BIN_ERR_ARGUMENT);
+                return;
+            }
+            traj_stop();
+            ramp_stop(payload[0]);
+            torque_set_target(payload[0], target);
+            break;
+        }
+        case BIN_OP_EXIT:
+            if (payload_len != 0) {
+                send_nack(opcode, BIN_ERR_LENGTH);
+                return;
+            }
+            bin_mode = false;
+            break;
+        default:
+            send_nack(opcode, BIN_ERR_OPCODE);
+            return;
+    }
+
+    send_frame(reply, reply_len);
+}
+
+void bin_send_telemetry(void) {
+    uint8_t report[FRAME_MAXLEN];
+    uint8_t len = 1;
+    uint8_t faults = 0;
+    telemetry_snapshot_t snapshot;
+    telemetry_snapshot(&snapshot);
+
+    report[0] = BIN_MSG_TELEMETRY;
+    for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+        write_u16(&report[len], (uint16_t)snapshot.outputs[i].value);
+        len += 2;
+    }
+    for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+        write_u16(&report[len], snapshot.outputs[i].current);
+        len += 2;
+        if (snapshot.outputs[i].in_fault) {
+            faults |= (1 << i);
+        }
+    }
+    report[len++] = faults;
+    write_u16(&report[len], snapshot.input_voltage);
+    len += 2;
+
+    send_frame(report, len);
+}
+
+void bin_mode_enter(void) {
+    frame_len = 0;
+    frame_overflow = false;
+    last_frame_time = clock_millis();
+    bin_mode = true;
+}
+
+bool bin_mode_active(void) {
+    return bin_mode;
+}
+
+void bin_check_timeout(void) {
+    if (bin_mode && (clock_millis() - last_frame_time) > BIN_TIMEOUT_MS) {
+        bin_mode = false;
+    }
+}
+
+void bin_process_received_data(uint8_t new_data) {
+    if (new_data != 0) {
+        if (frame_len < ENCODED_MAXLEN) {
+            frame_buffer[frame_len++] = new_data;
+        } else {
+            // drop the frame, resync at the next delimiter
+            frame_overflow = true;
+        }
+        return;
+    }
+
+    uint8_t len = frame_len;
+    bool overflow = frame_overflow;
+    frame_len = 0;
+    frame_overflow = false;
+
+    if (len == 0) {
+        // back-to-back delimiters are used to resync
+        return;
+    }
+    if (overflow) {
+        send_nack(0, BIN_ERR_LENGTH);
+        return;
+    }
+
+    len = cobs_decode(frame_buffer, len);
+    // need at least an opcode and the crc
+    if (len < 3 || crc16(frame_buffer, len - 2) != read_u16(&frame_buffer[len - 2])) {
+        send_nack(0, BIN_ERR_CRC);
+        return;
+    }
+
+    last_frame_time = clock_millis();
+    handle_frame(frame_buffer, len - 2);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Frames are COBS encoded and delimited by a zero byte:
+//   <opcode> <payload...> <crc16 LE>
+// All multi-byte fields are little-endian.
+#define BIN_OP_SET 0x01  // u8 output, i16 value
+#define BIN_OP_SET_ALL 0x02  // i16 value per output
+#define BIN_OP_GET 0x03  // u8 output -> u8 enabled, i16 value, u16 current
+#define BIN_OP_DISABLE 0x04  // u8 output, 0xFF for all outputs
+#define BIN_OP_STATUS 0x05  // -> u8 fault bitmask, u16 input voltage
+#define BIN_OP_TELEMETRY 0x06  // u16 rate in Hz, 0 to stop
+#define BIN_OP_SET_CURRENT 0x07  // u8 output, i16 target current in mA
+#define BIN_OP_EXIT 0x7F  // return to the ASCII protocol
+
+// Replies carry the request opcode with the top bit set
+#define BIN_REPLY_FLAG 0x80
+#define BIN_OP_NACK 0xFF  // u8 request opcode, u8 error
+// Unsolicited telemetry report:
+//   i16 value per output, u16 current per output, u8 fault bitmask, u16 input voltage
+#define BIN_MSG_TELEMETRY 0xC0
+
+#define BIN_ERR_CRC 0x01
+#define BIN_ERR_LENGTH 0x02
+#define BIN_ERR_ARGUMENT 0x03
+#define BIN_ERR_OPCODE 0x04
+
+// Leave binary mode if no valid frame is received for this long
+#define BIN_TIMEOUT_MS 1000
+
+void bin_mode_enter(void);
+bool bin_mode_active(void);
+void bin_check_timeout(void);
+void bin_process_received_data(uint8_t new_data);
+void bin_send_telemetry(void);
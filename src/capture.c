@@ -0,0 +1,120 @@
+#include "capture.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "output.h"
+
+#define CAPTURE_MASK (CAPTURE_DEPTH - 1)
+
+static capture_sample_t capture_buffer[CAPTURE_DEPTH];
+
+static volatile capture_state_t state = CAPTURE_IDLE;
+static capture_trigger_t trigger_source = CAPTURE_TRIG_NONE;
+static uint16_t trigger_threshold = 0;
+static uint8_t decimation = 1;
+static uint8_t decimation_count = 0;
+static uint16_t pre_trigger_len = 0;
+
+static uint16_t write_idx = 0;
+static uint16_t recorded = 0;  // valid samples in the buffer
+static uint16_t remaining = 0;  // post-trigger samples still to record
+
+void capture_set_trigger(capture_trigger_t source, uint16_t threshold_raw) {
+    capture_stop();
+    trigger_source = source;
+    trigger_threshold = threshold_raw;
+}
+
+void capture_arm(uint8_t decimation_val, uint16_t pre_trigger) {
+    capture_stop();
+
+    decimation = (decimation_val == 0)?(1):(decimation_val);
+    decimation_count = 0;
+    pre_trigger_len = (pre_trigger >= CAPTURE_DEPTH)?(CAPTURE_DEPTH - 1):(pre_trigger);
+    write_idx = 0;
+    recorded = 0;
+    remaining = CAPTURE_DEPTH - pre_trigger_len;
+
+    // The ISR only looks at the buffer once armed
+    state = CAPTURE_ARMED;
+}
+
+void capture_stop(void) {
+    state = CAPTURE_IDLE;
+}
+
+capture_state_t capture_get_state(void) {
+    return state;
+}
+
+uint16_t capture_get_count(void) {
+    return recorded;
+}
+
+uint8_t capture_get_decimation(void) {
+    return decimation;
+}
+
+uint16_t capture_get_pre_trigger(void) {
+    return pre_trigger_len;
+}
+
+bool capture_read(uint16_t index, capture_sample_t* sample) {
+    // Read from a finished capture, index 0 is the oldest sample
+    if (state != CAPTURE_DONE || index >= recorded) {
+        return false;
+    }
+    // A finished capture always fills the whole buffer
+    *sample = capture_buffer[(write_idx + index) & CAPTURE_MASK];
+    return true;
+}
+
+static bool triggered(uint16_t m0_raw, uint16_t m1_raw) {
+    switch (trigger_source) {
+        case CAPTURE_TRIG_M0:
+            return m0_raw > trigger_threshold;
+        case CAPTURE_TRIG_M1:
+            return m1_raw > trigger_threshold;
+        case CAPTURE_TRIG_FAULT:
+            for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+                if (output_data[i].in_fault) {
+                    return true;
+                }
+            }
+            return false;
+        case CAPTURE_TRIG_NONE:
+        default:
+            return true;
+    }
+}
+
+void capture_sample(uint16_t m0_raw, uint16_t m1_raw, uint16_t voltage_raw) {
+    // Called from the ADC ISR for every scan
+    if (state != CAPTURE_ARMED && state != CAPTURE_TRIGGERED) {
+        return;
+    }
+
+    if (++decimation_count < decimation) {
+        return;
+    }
+    decimation_count = 0;
+
+    if (state == CAPTURE_ARMED && recorded >= pre_trigger_len && triggered(m0_raw, m1_raw)) {
+        state = CAPTURE_TRIGGERED;
+        // Only keep the requested pre-trigger history
+        recorded = pre_trigger_len;
+    }
+
+    capture_buffer[write_idx].m0_current = m0_raw;
+    capture_buffer[write_idx].m1_current = m1_raw;
+    capture_buffer[write_idx].voltage = voltage_raw;
+    write_idx = (write_idx + 1) & CAPTURE_MASK;
+    if (recorded < CAPTURE_DEPTH) {
+        recorded++;
+    }
+
+    if (state == CAPTURE_TRIGGERED && --remaining == 0) {
+        state = CAPTURE_DONE;
+    }
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Must be a power of two, each sample holds all 3 channels
+#define CAPTURE_DEPTH 256
+
+typedef enum {
+    CAPTURE_IDLE,
+    CAPTURE_ARMED,  // recording pre-trigger samples, waiting for the trigger
+    CAPTURE_TRIGGERED,  // recording post-trigger samples
+    CAPTURE_DONE,
+} capture_state_t;
+
+typedef enum {
+    CAPTURE_TRIG_NONE,  // trigger as soon as the pre-trigger samples are recorded
+    CAPTURE_TRIG_M0,  // M0 current above the threshold
+    CAPTURE_TRIG_M1,  // M1 current above the threshold
+    CAPTURE_TRIG_FAULT,  // any output reporting a fault
+} capture_trigger_t;
+
+typedef struct {
+    uint16_t m0_current;
+    uint16_t m1_current;
+    uint16_t voltage;
+} capture_sample_t;
+
+void capture_set_trigger(capture_trigger_t source, uint16_t threshold_raw);
+void capture_arm(uint8_t decimation, uint16_t pre_trigger);
+void capture_stop(void);
+capture_state_t capture_get_state(void);
+uint16_t capture_get_count(void);
+uint8_t capture_get_decimation(void);
+uint16_t capture_get_pre_trigger(void);
+bool capture_read(uint16_t index, capture_sample_t* sample);
+
+void capture_sample(uint16_t m0_raw, uint16_t m1_raw, uint16_t voltage_raw);
@@ -0,0 +1,33 @@
+#include "clock.h"
+
+#include <libopencm3/cm3/systick.h>
+#include <libopencm3/cm3/nvic.h>
+
+#include "ramp.h"
+#include "sched.h"
+#include "events.h"
+
+static volatile uint32_t system_millis = 0;
+
+void clock_init(void) {
+    // 24MHz / 24000 = 1kHz tick
+    systick_set_clocksource(STK_CSR_CLKSOURCE_AHB);
+    systick_set_reload(24000 - 1);
+    systick_clear();
+    systick_interrupt_enable();
+    systick_counter_enable();
+}
+
+void sys_tick_handler(void) {
+    system_millis++;
+    // Ramps are stepped here so their rate doesn't depend on the main loop
+    ramp_tick();
+    sched_tick();
+    // The main loop runs at least every tick to service timeouts,
+    // scheduled tasks and the watchdog
+    events_signal();
+}
+
+uint32_t clock_millis(void) {
+    return system_millis;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdint.h>
+
+// Independent watchdog period, serviced from the main loop
+#define WATCHDOG_PERIOD_MS 50
+
+void clock_init(void);
+uint32_t clock_millis(void);
@@ -0,0 +1,321 @@
+#include "config.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <libopencm3/stm32/flash.h>
+#include <libopencm3/stm32/iwdg.h>
+
+#include "analogue.h"
+#include "output.h"
+#include "usart.h"
+#include "ilimit.h"
+#include "clock.h"
+
+// Each page starts with a header, <magic>:<version>:<sequence low>:<sequence high>,
+// followed by records appended as values are committed,
+// <key>:<value low>:<value high>:<crc>, all in half-words as the flash is
+// programmed. The page with the highest sequence is loaded, later records
+// replacing earlier ones, and when it is full the values are compacted into
+// the other page.
+#define PAGE_MAGIC 0xC0F6
+#define BLANK 0xFFFF
+#define HEADER_WORDS 4
+#define RECORD_WORDS 4
+#define RECORDS_PER_PAGE (((CONFIG_PAGE_SIZE / 2) - HEADER_WORDS) / RECORD_WORDS)
+#define NO_PAGE 0xFF
+#define FLASH_ERRORS (FLASH_SR_PGERR | FLASH_SR_WRPRTERR)
+// A page erase takes up to 40ms. The watchdog's LSI clock can run at up to
+// 60kHz rather than 40kHz, which cuts its normal period to about 33ms.
+#define ERASE_WATCHDOG_MS 200
+
+// Reserved by the linker script
+extern uint8_t _config_start[];
+
+typedef struct {
+    int32_t def;
+    int32_t min;
+    int32_t max;
+} config_param_t;
+
+static const config_param_t params[CONFIG_NUM_KEYS] = {
+    // 3300/(4096 * 1100) * 7000 mA per code
+    [CONFIG_CURRENT_SCALE] = {.def = 2625, .min = 1, .max = 8000},
+    // (3300/4096) * 5400/1100 mV per code
+    [CONFIG_VOLTAGE_SCALE] = {.def = 2025, .min = 1, .max = 8000},
+    [CONFIG_LED_CURRENT] = {.def = 5000, .min = 0, .max = 20000},
+    [CONFIG_FILTER_CUTOFF] = {.def = 50, .min = 0, .max = CURRENT_FILTER_MAX_CUTOFF},
+    [CONFIG_FILTER_STAGES] = {.def = 1, .min = 1, .max = CURRENT_FILTER_MAX_STAGES},
+    // Only the supported rates are accepted, see value_valid()
+    [CONFIG_PWM_FREQUENCY] = {.def = 6000, .min = 0, .max = UINT16_MAX},
+    [CONFIG_BAUD] = {.def = USART_DEFAULT_BAUD, .min = 0, .max = INT32_MAX},
+};
+
+static int32_t values[CONFIG_NUM_KEYS];
+static int32_t stored[CONFIG_NUM_KEYS];  // what would be loaded from flash
+static uint8_t active_page = NO_PAGE;
+static uint32_t active_sequence = 0;
+static uint8_t used_records = 0;  // including any that failed their CRC
+
+static const uint16_t* page_data(uint8_t page) {
+    return (const uint16_t*)(_config_start + (page * CONFIG_PAGE_SIZE));
+}
+
+static const uint16_t* record_data(uint8_t page, uint8_t record) {
+    return page_data(page) + HEADER_WORDS + (record * RECORD_WORDS);
+}
+
+static uint16_t crc16(const uint16_t* data, uint8_t len) {
+    // CRC-16/CCITT over the half-words, low byte first
+    uint16_t crc = 0xFFFF;
+    for (uint8_t i = 0; i < len; i++) {
+        for (uint8_t shift = 0; shift < 16; shift += 8) {
+            crc ^= (uint16_t)(((data[i] >> shift) & 0xFF) << 8);
+            for (uint8_t bit = 0; bit < 8; bit++) {
+                crc = (crc & 0x8000)?((uint16_t)(crc << 1) ^ 0x1021):((uint16_t)(crc << 1));
+            }
+        }
+    }
+    return crc;
+}
+
+static bool value_valid(config_key_t key, int32_t value) {
+    if (value < params[key].min || value > params[key].max) {
+        return false;
+    }
+    switch (key) {
+        case CONFIG_PWM_FREQUENCY:
+            return output_pwm_frequency_supported((uint16_t)value);
+        case CONFIG_BAUD:
+            return usart_baud_supported((uint32_t)value);
+        default:
+            return true;
+    }
+}
+
+static void load_page(uint8_t page) {
+    used_records = 0;
+    for (uint8_t i = 0; i < RECORDS_PER_PAGE; i++) {
+        const uint16_t* record = record_data(page, i);
+        if (record[0] == BLANK) {
+            break;
+        }
+        used_records++;
+
+        // A record that was being written at power off fails its CRC
+        if (record[3] != crc16(record, 3) || !(record[0] < CONFIG_NUM_KEYS)) {
+            continue;
+        }
+        int32_t value = (int32_t)((uint32_t)record[1] | ((uint32_t)record[2] << 16));
+        if (value_valid(record[0], value)) {
+            stored[record[0]] = value;
+        }
+    }
+}
+
+void config_init(void) {
+    for (uint8_t i = 0; i < CONFIG_NUM_KEYS; i++) {
+        stored[i] = params[i].def;
+    }
+
+    active_page = NO_PAGE;
+    for (uint8_t page = 0; page < CONFIG_NUM_PAGES; page++) {
+        const uint16_t* header = page_data(page);
+        if (header[0] != PAGE_MAGIC || header[1] != CONFIG_FORMAT_VERSION) {
+            continue;
+        }
+        uint32_t sequence = (uint32_t)header[2] | ((uint32_t)header[3] << 16);
+        if (active_page == NO_PAGE || sequence > active_sequence) {
+            active_page = page;
+            active_sequence = sequence;
+        }
+    }
+    if (active_page != NO_PAGE) {
+        load_page(active_page);
+    }
+
+    for (uint8_t i = 0; i < CONFIG_NUM_KEYS; i++) {
+        values[i] = stored[i];
+    }
+}
+
+int32_t config_get(config_key_t key) {
+    if (!(key < CONFIG_NUM_KEYS)) {
+        // skip invalid keys
+        return 0;
+    }
+    return values[key];
+}
+
+static void apply(config_key_t key) {
+    switch (key) {
+        case CONFIG_CURRENT_SCALE:
+            // The limits are compared in ADC codes
+            ilimit_update_thresholds();
+            break;
+        case CONFIG_FILTER_CUTOFF:
+        case CONFIG_FILTER_STAGES:
+            for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+                analogue_set_filter(i, (uint16_t)values[CONFIG_FILTER_CUTOFF], (uint8_t)values[CONFIG_FILTER_STAGES]);
+            }
+            break;
+        case CONFIG_PWM_FREQUENCY:
+            output_set_pwm_frequency((uint16_t)values[CONFIG_PWM_FREQUENCY]);
+            break;
+        default:
+            // Read where they are used, the baud rate by *SYS:BAUD
+            break;
+    }
+}
+
+bool config_set(config_key_t key, int32_t value) {
+    if (!(key < CONFIG_NUM_KEYS) || !value_valid(key, value)) {
+        return false;
+    }
+    values[key] = value;
+    apply(key);
+    return true;
+}
+
+static bool program(const uint16_t* dest, uint16_t data) {
+    // Programming a half-word that isn't blank sets PGERR
+    flash_clear_status_flags();
+    flash_program_half_word((uint32_t)dest, data);
+    return ((flash_get_status_flags() & FLASH_ERRORS) == 0) && (*(volatile const uint16_t*)dest == data);
+}
+
+static bool program_record(const uint16_t* dest, config_key_t key, int32_t value) {
+    uint16_t record[RECORD_WORDS] = {
+        (uint16_t)key,
+        (uint16_t)((uint32_t)value & 0xFFFF),
+        (uint16_t)((uint32_t)value >> 16),
+        0,
+    };
+    record[3] = crc16(record, 3);
+    for (uint8_t i = 0; i < RECORD_WORDS; i++) {
+        if (!program(&dest[i], record[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void set_watchdog_period(uint32_t period_ms) {
+    iwdg_set_period_ms(period_ms);
+    // The new values take a few LSI cycles to reach the watchdog, a reload
+    // before then would still count down the old period
+    while (iwdg_prescaler_busy() || iwdg_reload_busy()) {
+        // PVU and RVU clear once the update is done
+    }
+    iwdg_reset();
+}
+
+static bool compact(void) {
+    // Writes the values that aren't defaults to the other page. The old
+    // page is loaded until the new header is complete, so a power cut
+    // part way through loses nothing.
+    uint8_t page = (active_page == 0)?(1):(0);
+    const uint16_t* header = page_data(page);
+
+    // Interrupts can't run from flash during the erase either, so received
+    // bytes are lost and SysTick misses ticks
+    set_watchdog_period(ERASE_WATCHDOG_MS);
+    flash_clear_status_flags();
+    flash_erase_page((uint32_t)header);
+    set_watchdog_period(WATCHDOG_PERIOD_MS);
+    if (flash_get_status_flags() & FLASH_ERRORS) {
+        return false;
+    }
+
+    uint8_t records = 0;
+    for (uint8_t i = 0; i < CONFIG_NUM_KEYS; i++) {
+        if (values[i] == params[i].def) {
+            continue;
+        }
+        if (!program_record(record_data(page, records), i, values[i])) {
+            return false;
+        }
+        records++;
+    }
+
+    // The magic goes last so an interrupted page is never loaded
+    uint32_t sequence = active_sequence + 1;
+    if (
+        !program(&header[2], (uint16_t)(sequence & 0xFFFF))
+        || !program(&header[3], (uint16_t)(sequence >> 16))
+        || !program(&header[1], CONFIG_FORMAT_VERSION)
+        || !program(&header[0], PAGE_MAGIC)
+    ) {
+        return false;
+    }
+
+    active_page = page;
+    active_sequence = sequence;
+    used_records = records;
+    for (uint8_t i = 0; i < CONFIG_NUM_KEYS; i++) {
+        stored[i] = values[i];
+    }
+    return true;
+}
+
+static uint8_t count_pending(void) {
+    uint8_t pending = 0;
+    for (uint8_t i = 0; i < CONFIG_NUM_KEYS; i++) {
+        if (values[i] != stored[i]) {
+            pending++;
+        }
+    }
+    return pending;
+}
+
+bool config_commit(void) {
+    uint8_t pending = count_pending();
+    if (pending == 0) {
+        return true;
+    }
+
+    bool ok = true;
+    flash_unlock();
+    if (active_page != NO_PAGE && (used_records + pending) <= RECORDS_PER_PAGE) {
+        // Append the changes, only compacting when the page is full spreads
+        // the erases over both pages
+        for (uint8_t i = 0; i < CONFIG_NUM_KEYS && ok; i++) {
+            if (values[i] == stored[i]) {
+                continue;
+            }
+            // A failed record still takes its slot
+            ok = program_record(record_data(active_page, used_records++), i, values[i]);
+            if (ok) {
+                stored[i] = values[i];
+            }
+        }
+    } else {
+        ok = compact();
+    }
+    flash_lock();
+    return ok;
+}
+
+bool config_factory_reset(void) {
+    for (uint8_t i = 0; i < CONFIG_NUM_KEYS; i++) {
+        values[i] = params[i].def;
+        apply(i);
+    }
+    if (active_page == NO_PAGE) {
+        // nothing stored
+        return true;
+    }
+
+    // An empty page loads as the defaults
+    flash_unlock();
+    bool ok = compact();
+    flash_lock();
+    return ok;
+}
+
+void config_get_status(config_status_t* status) {
+    status->pending = count_pending();
+    status->records = used_records;
+    status->free_records = (active_page != NO_PAGE)?(RECORDS_PER_PAGE - used_records):(0);
+    status->sequence = active_sequence;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Power on settings, kept in the last two flash pages, see utils/stm32-mcv4.ld
+#define CONFIG_PAGE_SIZE 1024
+#define CONFIG_NUM_PAGES 2
+// Bumped when the record layout changes, stored pages of another version are ignored
+#define CONFIG_FORMAT_VERSION 1
+
+// The numbers are stored in flash, so keys must never be renumbered or reused
+typedef enum {
+    CONFIG_CURRENT_SCALE = 0,  // current sense, mA per ADC code in 1/512ths
+    CONFIG_VOLTAGE_SCALE = 1,  // 12V sense, mV per ADC code in 1/512ths
+    CONFIG_LED_CURRENT = 2,  // blue LED threshold, mA
+    CONFIG_FILTER_CUTOFF = 3,  // reported current filter, Hz
+    CONFIG_FILTER_STAGES = 4,
+    CONFIG_PWM_FREQUENCY = 5,  // Hz
+    CONFIG_BAUD = 6,  // serial rate switched to by *SYS:BAUD without a rate
+    CONFIG_NUM_KEYS,
+} config_key_t;
+
+typedef struct {
+    uint8_t pending;  // keys changed since the last commit
+    uint8_t records;  // in the active page
+    uint8_t free_records;
+    uint32_t sequence;  // of the active page, counts the pages written
+} config_status_t;
+
+// Loads the stored values, before the modules that use them are initialised
+void config_init(void);
+int32_t config_get(config_key_t key);
+// Applies the value straight away, false if it is out of range
+bool config_set(config_key_t key, int32_t value);
+// Return false if the flash couldn't be written. Both can erase a page,
+// which stalls the CPU for up to 40ms.
+bool config_commit(void);
+bool config_factory_reset(void);
+void config_get_status(config_status_t* status);
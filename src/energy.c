@@ -0,0 +1,79 @@
+#include "energy.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <libopencm3/cm3/cortex.h>
+
+#include "output.h"
+
+// Accumulated units per uAh, mA * us/16
+#define CHARGE_PER_UAH (3600000ULL << ENERGY_PERIOD_SHIFT)
+// Accumulated units per uWh, (mA * mV / 1024) * us/16
+#define ENERGY_PER_UWH ((3600000000ULL << ENERGY_PERIOD_SHIFT) >> 10)
+
+typedef struct {
+    // At full scale these take days to wrap, months at typical loads
+    uint64_t charge;
+    uint64_t energy;
+} energy_accumulator_t;
+
+static energy_accumulator_t accumulators[NUM_OUTPUTS];
+static uint32_t sample_period = 0;  // us/16
+
+void energy_set_sample_rate(uint32_t rate_hz) {
+    if (rate_hz == 0) {
+        return;
+    }
+    // Used by the ISR on the next scan
+    sample_period = ((1000000UL << ENERGY_PERIOD_SHIFT) + (rate_hz / 2)) / rate_hz;
+}
+
+void energy_update(uint16_t m0_current, uint16_t m1_current, uint16_t voltage_mv) {
+    uint16_t currents[NUM_OUTPUTS] = {m0_current, m1_current};
+    for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+        // 16 x 16 bit products and the period fit in 32 bits after the shift
+        uint32_t power = ((uint32_t)currents[i] * voltage_mv) >> 10;
+        accumulators[i].charge += (uint64_t)currents[i] * sample_period;
+        accumulators[i].energy += (uint64_t)power * sample_period;
+    }
+}
+
+static void convert(uint64_t charge, uint64_t energy, energy_reading_t* reading) {
+    uint64_t charge_uah = charge / CHARGE_PER_UAH;
+    uint64_t energy_uwh = energy / ENERGY_PER_UWH;
+    reading->charge_uah = (charge_uah > UINT32_MAX)?(UINT32_MAX):((uint32_t)charge_uah);
+    reading->energy_uwh = (energy_uwh > UINT32_MAX)?(UINT32_MAX):((uint32_t)energy_uwh);
+}
+
+void energy_get_output(uint8_t output_num, energy_reading_t* reading) {
+    if (!(output_num < NUM_OUTPUTS)) {
+        // skip invalid output numbers
+        return;
+    }
+    energy_accumulator_t acc;
+    CM_ATOMIC_BLOCK() {
+        acc = accumulators[output_num];
+    }
+    convert(acc.charge, acc.energy, reading);
+}
+
+void energy_get_total(energy_reading_t* reading) {
+    uint64_t charge = 0;
+    uint64_t energy = 0;
+    CM_ATOMIC_BLOCK() {
+        for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+            charge += accumulators[i].charge;
+            energy += accumulators[i].energy;
+        }
+    }
+    convert(charge, energy, reading);
+}
+
+void energy_reset(void) {
+    CM_ATOMIC_BLOCK() {
+        for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+            accumulators[i].charge = 0;
+            accumulators[i].energy = 0;
+        }
+    }
+}
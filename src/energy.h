@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Each scan is weighted by the scan period in 1/16ths of a us
+#define ENERGY_PERIOD_SHIFT 4
+
+typedef struct {
+    uint32_t charge_uah;
+    uint32_t energy_uwh;
+} energy_reading_t;
+
+// Must be called when the sample rate changes
+void energy_set_sample_rate(uint32_t rate_hz);
+// Called from adc1_2_isr with the unfiltered currents
+void energy_update(uint16_t m0_current, uint16_t m1_current, uint16_t voltage_mv);
+
+void energy_get_output(uint8_t output_num, energy_reading_t* reading);
+void energy_get_total(energy_reading_t* reading);
+void energy_reset(void);
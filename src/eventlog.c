@@ -0,0 +1,163 @@
+#include "eventlog.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/pwr.h>
+#include <libopencm3/stm32/f1/bkp.h>
+#include <libopencm3/cm3/cortex.h>
+
+#include "clock.h"
+
+#define EVENTLOG_MASK (EVENTLOG_DEPTH - 1)
+// BKP_DR10 holds this marker with the next slot and valid entry count
+#define BACKUP_MARKER 0xE500
+#define BACKUP_REGS_PER_ENTRY 4
+
+static eventlog_entry_t entries[EVENTLOG_DEPTH];
+static uint8_t head = 0;  // next entry to write
+static uint8_t count = 0;
+static uint32_t dropped = 0;  // overwritten before being read
+
+// BKP_DR1 is the bootloader flag, entries use BKP_DR2-9
+static volatile uint32_t* const backup_regs[EVENTLOG_BACKUP_ENTRIES * BACKUP_REGS_PER_ENTRY] = {
+    &BKP_DR2, &BKP_DR3, &BKP_DR4, &BKP_DR5,
+    &BKP_DR6, &BKP_DR7, &BKP_DR8, &BKP_DR9,
+};
+static uint8_t backup_next = 0;
+static uint8_t backup_valid = 0;
+
+static void push_entry(const eventlog_entry_t* entry) {
+    // Must be called with interrupts masked
+    entries[head] = *entry;
+    head = (head + 1) & EVENTLOG_MASK;
+    if (count == EVENTLOG_DEPTH) {
+        dropped++;
+    } else {
+        count++;
+    }
+}
+
+static void backup_entry(const eventlog_entry_t* entry) {
+    // Must be called with interrupts masked, so the write protection
+    // isn't re-enabled under set_bootloader_signature()
+    volatile uint32_t* const* regs = &backup_regs[backup_next * BACKUP_REGS_PER_ENTRY];
+    backup_next = (backup_next + 1) % EVENTLOG_BACKUP_ENTRIES;
+    if (backup_valid < EVENTLOG_BACKUP_ENTRIES) {
+        backup_valid++;
+    }
+
+    // The backup registers are 16 bits wide
+    pwr_disable_backup_domain_write_protect();
+    *regs[0] = entry->time & 0xFFFF;
+    *regs[1] = entry->time >> 16;
+    *regs[2] = ((uint32_t)entry->type << 8) | entry->arg;
+    *regs[3] = entry->value;
+    BKP_DR10 = BACKUP_MARKER | (backup_next << 4) | backup_valid;
+    pwr_enable_backup_domain_write_protect();
+}
+
+static bool survives_reset(eventlog_type_t type) {
+    // Only the events that explain a reset, so the two slots aren't
+    // taken by a NACK or a fault clearing after them
+    switch (type) {
+        case EVENT_RESET:
+        case EVENT_FAULT:
+        case EVENT_OVERCURRENT:
+        case EVENT_UNDERVOLTAGE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void restore_backup(void) {
+    // Entries from before the reset are returned ahead of this boot's
+    uint32_t marker = BKP_DR10 & 0xFFFF;
+    if ((marker & 0xFF00) != BACKUP_MARKER) {
+        return;
+    }
+    uint8_t valid = marker & 0x0F;
+    uint8_t slot = (marker >> 4) & 0x0F;
+    if (valid > EVENTLOG_BACKUP_ENTRIES || slot >= EVENTLOG_BACKUP_ENTRIES) {
+        return;
+    }
+
+    slot = (slot + EVENTLOG_BACKUP_ENTRIES - valid) % EVENTLOG_BACKUP_ENTRIES;
+    for (uint8_t i = 0; i < valid; i++) {
+        volatile uint32_t* const* regs = &backup_regs[slot * BACKUP_REGS_PER_ENTRY];
+        eventlog_entry_t entry = {
+            .time = (*regs[0] & 0xFFFF) | ((*regs[1] & 0xFFFF) << 16),
+            .type = (uint8_t)((*regs[2] >> 8) & 0xFF),
+            .arg = (uint8_t)(*regs[2] & 0xFF),
+            .value = (uint16_t)(*regs[3] & 0xFFFF),
+            .previous_boot = true,
+        };
+        if (entry.type < EVENT_NUM_TYPES) {
+            push_entry(&entry);
+        }
+        slot = (slot + 1) % EVENTLOG_BACKUP_ENTRIES;
+    }
+}
+
+void eventlog_init(void) {
+    // Needs the PWR and BKP clocks
+    restore_backup();
+
+    // Start this boot's backup copy afresh so old entries aren't restored twice
+    pwr_disable_backup_domain_write_protect();
+    BKP_DR10 = 0;
+    pwr_enable_backup_domain_write_protect();
+
+    // The flags accumulate until cleared, so only this reset's cause is kept
+    uint8_t cause = (uint8_t)(RCC_CSR >> 24) & 0xFC;
+    RCC_CSR |= RCC_CSR_RMVF;
+    eventlog_record(EVENT_RESET, cause, 0);
+}
+
+void eventlog_record(eventlog_type_t type, uint8_t arg, uint16_t value) {
+    eventlog_entry_t entry = {
+        .time = clock_millis(),
+        .type = (uint8_t)type,
+        .arg = arg,
+        .value = value,
+        .previous_boot = false,
+    };
+    CM_ATOMIC_BLOCK() {
+        push_entry(&entry);
+        if (survives_reset(type)) {
+            backup_entry(&entry);
+        }
+    }
+}
+
+uint8_t eventlog_count(void) {
+    return count;
+}
+
+uint32_t eventlog_dropped(void) {
+    return dropped;
+}
+
+bool eventlog_get(uint8_t index, eventlog_entry_t* entry) {
+    bool valid = false;
+    CM_ATOMIC_BLOCK() {
+        if (index < count) {
+            *entry = entries[(head - count + index) & EVENTLOG_MASK];
+            valid = true;
+        }
+    }
+    return valid;
+}
+
+void eventlog_clear(void) {
+    CM_ATOMIC_BLOCK() {
+        count = 0;
+        dropped = 0;
+        backup_next = 0;
+        backup_valid = 0;
+        pwr_disable_backup_domain_write_protect();
+        BKP_DR10 = 0;
+        pwr_enable_backup_domain_write_protect();
+    }
+}
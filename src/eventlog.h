@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Must be a power of two so the indices can wrap with a mask
+#define EVENTLOG_DEPTH 32
+// The most recent RESET, FAULT, OVERCURRENT and UNDERVOLTAGE entries are
+// also kept in the backup registers
+#define EVENTLOG_BACKUP_ENTRIES 2
+
+typedef enum {
+    EVENT_RESET,  // arg: reset cause bits, RCC_CSR >> 24
+    EVENT_FAULT,  // arg: output, value: current mA
+    EVENT_FAULT_CLEAR,  // arg: output, value: current mA
+    EVENT_OVERCURRENT,  // arg: output, value: current mA
+    EVENT_UNDERVOLTAGE,  // value: input mV
+    EVENT_VOLTAGE_OK,  // value: input mV
+    EVENT_COMMAND_ERROR,  // arg: eventlog_cmd_error_t
+    EVENT_NUM_TYPES,
+} eventlog_type_t;
+
+typedef enum {
+    EVENT_CMD_NACK,  // rejected by its handler
+    EVENT_CMD_TOO_LONG,
+    EVENT_CMD_OVERFLOW,
+    EVENT_CMD_BAD_TAG,
+} eventlog_cmd_error_t;
+
+typedef struct {
+    uint32_t time;  // clock_millis() when recorded
+    uint8_t type;
+    uint8_t arg;
+    uint16_t value;
+    bool previous_boot;  // restored from the backup registers
+} eventlog_entry_t;
+
+// Restores the backup copy and records the reset cause
+void eventlog_init(void);
+// Safe to call from interrupts
+void eventlog_record(eventlog_type_t type, uint8_t arg, uint16_t value);
+uint8_t eventlog_count(void);
+uint32_t eventlog_dropped(void);
+// index 0 is the oldest entry, returns false past the end
+bool eventlog_get(uint8_t index, eventlog_entry_t* entry);
+void eventlog_clear(void);
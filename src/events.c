@@ -0,0 +1,42 @@
+#include "events.h"
+
+#include <stdbool.h>
+
+#include <libopencm3/cm3/cortex.h>
+
+static volatile bool event_pending = false;
+
+static inline void wait_for_interrupt(void) {
+#ifdef HOST_SIM
+    sim_wait_for_interrupt();
+#else
+    __asm__ __volatile__("wfi");
+#endif
+}
+
+void events_signal(void) {
+    // A single store, so it is safe from any interrupt priority
+    event_pending = true;
+}
+
+void events_wait(void) {
+    // Sleep until an interrupt has signalled since the last call
+    while (true) {
+        cm_disable_interrupts();
+        if (event_pending) {
+            event_pending = false;
+            cm_enable_interrupts();
+            return;
+        }
+        // An interrupt pending while masked still wakes the core, so one
+        // arriving after the check can't be slept through
+        wait_for_interrupt();
+        // let the interrupt that woke us run
+        cm_enable_interrupts();
+    }
+}
+
+void events_sleep(void) {
+    // Sleep until the next interrupt of any kind, for short waits on hardware
+    wait_for_interrupt();
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+// Interrupts signal the main loop when they leave it work to do, it
+// sleeps between signals
+
+void events_signal(void);
+void events_wait(void);
+void events_sleep(void);
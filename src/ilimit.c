@@ -0,0 +1,158 @@
+#include "ilimit.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <libopencm3/cm3/cortex.h>
+
+#include "output.h"
+#include "analogue.h"
+#include "torque.h"
+#include "ramp.h"
+#include "eventlog.h"
+
+// Foldback cuts the duty limit to 7/8 for each scan over the limit and
+// recovers by this many 1/1000ths of full power each scan under it
+#define FOLD_RECOVERY 1
+
+typedef struct {
+    uint16_t limit_ma;  // 0 for no limit
+    uint16_t limit_raw;
+    ilimit_policy_t policy;
+    uint32_t trips;
+    bool over;  // in an overcurrent episode, counted once
+    uint16_t fold;  // duty limit, 1/1000ths of full power
+} current_limit_t;
+
+static current_limit_t limits[NUM_OUTPUTS];
+// Outputs the watchdog has handled during the current scan
+static uint8_t over_this_scan = 0;
+
+static void update_watchdog(void) {
+    // There is one watchdog for both currents, so it is set to the lowest
+    // limit and the interrupt checks each output against its own
+    uint16_t threshold = ANALOGUE_WATCHDOG_OFF;
+    for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+        if (limits[i].limit_ma != 0 && limits[i].limit_raw < threshold) {
+            threshold = limits[i].limit_raw;
+        }
+    }
+    analogue_set_current_watchdog(threshold);
+}
+
+void ilimit_set(uint8_t output_num, uint16_t limit_ma, ilimit_policy_t policy) {
+    if (!(output_num < NUM_OUTPUTS)) {
+        // skip invalid output numbers
+        return;
+    }
+    if (limit_ma > ILIMIT_MAX_CURRENT || policy >= ILIMIT_NUM_POLICIES) {
+        // skip invalid limits
+        return;
+    }
+
+    current_limit_t* limit = &limits[output_num];
+    CM_ATOMIC_BLOCK() {
+        limit->limit_ma = limit_ma;
+        limit->limit_raw = analogue_ma_to_raw(limit_ma);
+        limit->policy = policy;
+        limit->trips = 0;
+        limit->over = false;
+        limit->fold = MAX_MOTOR_VAL;
+        output_set_duty_limit(output_num, MAX_MOTOR_VAL);
+    }
+    update_watchdog();
+}
+
+uint16_t ilimit_get_limit(uint8_t output_num) {
+    if (!(output_num < NUM_OUTPUTS)) {
+        // skip invalid output numbers
+        return 0;
+    }
+    return limits[output_num].limit_ma;
+}
+
+ilimit_policy_t ilimit_get_policy(uint8_t output_num) {
+    if (!(output_num < NUM_OUTPUTS)) {
+        // skip invalid output numbers
+        return ILIMIT_CUT;
+    }
+    return limits[output_num].policy;
+}
+
+uint32_t ilimit_get_trips(uint8_t output_num) {
+    if (!(output_num < NUM_OUTPUTS)) {
+        // skip invalid output numbers
+        return 0;
+    }
+    return limits[output_num].trips;
+}
+
+void ilimit_reset(void) {
+    CM_ATOMIC_BLOCK() {
+        for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+            limits[i].fold = MAX_MOTOR_VAL;
+            output_set_duty_limit(i, MAX_MOTOR_VAL);
+        }
+    }
+}
+
+void ilimit_update_thresholds(void) {
+    // The limits are compared in ADC codes
+    CM_ATOMIC_BLOCK() {
+        for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+            limits[i].limit_raw = analogue_ma_to_raw(limits[i].limit_ma);
+        }
+    }
+    update_watchdog();
+}
+
+void ilimit_watchdog(uint16_t m0_raw, uint16_t m1_raw) {
+    // One of the currents is over the lowest limit. The other current may
+    // be from the previous scan if the watchdog fired part way through.
+    uint16_t raw[NUM_OUTPUTS] = {m0_raw, m1_raw};
+
+    for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+        current_limit_t* limit = &limits[i];
+        if (limit->limit_ma == 0 || raw[i] <= limit->limit_raw || (over_this_scan & (1 << i))) {
+            continue;
+        }
+        over_this_scan |= (1 << i);
+
+        if (!limit->over) {
+            limit->over = true;
+            limit->trips++;
+            eventlog_record(EVENT_OVERCURRENT, i, analogue_raw_to_ma(raw[i]));
+        }
+
+        switch (limit->policy) {
+            case ILIMIT_FOLD:
+                limit->fold = (limit->fold * 7) / 8;
+                output_set_duty_limit(i, limit->fold);
+                break;
+            case ILIMIT_LATCH:
+                output_inhibit(i);
+                // fall through
+            case ILIMIT_CUT:
+            default:
+                torque_release(i);
+                ramp_stop(i);
+                output_disable(i);
+                break;
+        }
+    }
+}
+
+void ilimit_scan_done(void) {
+    // Outputs the watchdog didn't flag this scan are back under their limit
+    for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+        current_limit_t* limit = &limits[i];
+        if (over_this_scan & (1 << i)) {
+            continue;
+        }
+        limit->over = false;
+        if (limit->fold < MAX_MOTOR_VAL) {
+            limit->fold += FOLD_RECOVERY;
+            output_set_duty_limit(i, limit->fold);
+        }
+    }
+    over_this_scan = 0;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define ILIMIT_MAX_CURRENT 20000  // mA, the full range of the current sense
+
+typedef enum {
+    ILIMIT_CUT,  // disable the output, it can be set again straight away
+    ILIMIT_FOLD,  // reduce the duty while over the limit, recovering after
+    ILIMIT_LATCH,  // disable the output until *RESET
+    ILIMIT_NUM_POLICIES,
+} ilimit_policy_t;
+
+// A limit of 0 removes it, also clears the trip count
+void ilimit_set(uint8_t output_num, uint16_t limit_ma, ilimit_policy_t policy);
+uint16_t ilimit_get_limit(uint8_t output_num);
+ilimit_policy_t ilimit_get_policy(uint8_t output_num);
+uint32_t ilimit_get_trips(uint8_t output_num);
+// Restores full duty, latched outputs are released by outputs_reset()
+void ilimit_reset(void);
+// Must be called when the current scale changes
+void ilimit_update_thresholds(void);
+
+// Called from adc1_2_isr when the analog watchdog fires, with the latest
+// conversion of each current
+void ilimit_watchdog(uint16_t m0_raw, uint16_t m1_raw);
+// Called from adc1_2_isr at the end of each scan
+void ilimit_scan_done(void);
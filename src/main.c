@@ -10,8 +10,17 @@
 #include "led.h"
 #include "output.h"
 #include "usart.h"
+#include "clock.h"
 #include "analogue.h"
 #include "msg_handler.h"
+#include "bin_handler.h"
+#include "telemetry.h"
+#include "stats.h"
+#include "events.h"
+#include "eventlog.h"
+#include "sched.h"
+#include "config.h"
+#include "traj.h"
 
 static void init(void) {
     rcc_clock_setup_pll(&rcc_hse_configs[RCC_CLOCK_HSE8_24MHZ]);
@@ -21,27 +30,56 @@ static void init(void) {
     rcc_periph_clock_enable(RCC_GPIOC);
     rcc_periph_clock_enable(RCC_PWR);
     rcc_periph_clock_enable(RCC_BKP);
+    stats_init();
+    clock_init();
+    eventlog_init();
+    // Before the modules that read their settings at init
+    config_init();
     led_init();
     output_init();
     usart_init();
     analogue_init();
+    traj_init();
+
+    // Housekeeping that doesn't need to run every ADC scan
+    sched_add(SCHED_FAULTS, 2, check_output_faults);
+    sched_add(SCHED_TELEMETRY, 1, telemetry_poll);
+    sched_add(SCHED_MONITOR, 10, analogue_monitor);
 
     // Configure watchdog. Period: 50ms
-    iwdg_set_period_ms(50);
+    iwdg_set_period_ms(WATCHDOG_PERIOD_MS);
     iwdg_start();
 }
 
+static void receive_pending(void) {
+    uint8_t c;
+    // Drain everything received so far, the ISR keeps receiving into the
+    // ring buffer while commands are handled. Text is left in the ring
+    // buffer while the command queue is full.
+    while ((bin_mode_active() || !command_queue_full()) && usart_get_char(&c)) {
+        if (bin_mode_active()) {
+            bin_process_received_data(c);
+        } else {
+            process_received_data((char)c);
+        }
+    }
+}
+
 static void enter_bootloader(void) {
     // Configure required clocks to write to backup registers
     rcc_periph_clock_enable(RCC_PWR);
     rcc_periph_clock_enable(RCC_BKP);
     set_bootloader_signature(0);  // reset bootloader signature so we don't repeatedly enter bootloader
+#ifdef HOST_SIM
+    sim_enter_bootloader();
+#else
     __asm__ __volatile__(
         "ldr r0, =0x1FFFF000;"  // load bootloader address into r0
         "ldr sp,[r0, #0];"      // Load bootloader address into stack pointer
         "ldr r0,[r0, #4];"      // Load bootloader start address into r0 (addr+4)
         "bx r0;"                // Jump to address in r0
     );
+#endif
 }
 
 int main(void) {
@@ -53,16 +91,32 @@ int main(void) {
     init();
 
     while (1) {
+        // Sleep until an interrupt leaves work, SysTick signals every 1ms
+        // so the watchdog is still serviced at that rate while idle
+        stats_pass_begin();
+        events_wait();
+        stats_pass_end(true);
+
+        stats_pass_begin();
         iwdg_reset();
-        uint16_t c = usart_get_char();
-        if (c & 0x100) {  // skip parity errors
-            continue;
+        receive_pending();
+        sched_run();
+        // Queued text commands run one at a time, receiving in between so
+        // the receive buffer is emptied while responses are sent, and
+        // running tasks so a full queue doesn't hold them up
+        while (process_next_command()) {
+            iwdg_reset();
+            receive_pending();
+            sched_run();
         }
-        process_received_data((char)(c & 0xff));
+        bin_check_timeout();
+        usart_poll();
 
         if (bootloader_flag == BOOTLOADER_SIGNATURE) {
+            usart_flush();  // make sure the ACK has been sent
             scb_reset_system();  // reset MCU to enter bootloader
         }
+        stats_pass_end(false);
     }
     return 0;
 }
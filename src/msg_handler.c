@@ -1,179 +1,1292 @@
-#include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
-#include <ctype.h>
 
 #include "msg_handler.h"
 #include "output.h"
 #include "analogue.h"
 #include "usart.h"
+#include "bin_handler.h"
+#include "telemetry.h"
+#include "capture.h"
+#include "torque.h"
+#include "ramp.h"
+#include "stats.h"
+#include "eventlog.h"
+#include "energy.h"
+#include "ilimit.h"
+#include "sched.h"
+#include "config.h"
+#include "traj.h"
 
 #define BOARD_NAME_SHORT "MCv4B"
 #define MSG_MAXLEN 64
 #define USB_BUFFER_SIZE 64
+// Most arguments any command takes, including the command words
+#define MAX_ARGS 8
+// Capture samples sent per line of a CAP:READ? dump
+#define CAPTURE_SAMPLES_PER_LINE 6
+// Received lines waiting to be handled, the most commands a host can have in flight
+#define COMMAND_QUEUE_LEN 4
+// Sequence tags are @<seq>: with up to this many digits
+#define MAX_TAG_DIGITS 5
+
+typedef enum {
+    LINE_OK,
+    LINE_TOO_LONG,  // the start of the line was kept
+    LINE_DROPPED,  // bytes of the line were lost by the USART
+} line_status_t;
+
+typedef struct {
+    char line[MSG_MAXLEN];
+    line_status_t status;
+} queued_command_t;
 
 const char serialnum[] __attribute__((section(".sernum"))) = "XXXXXXXXXXXXXXX";
 char msg_buffer[MSG_MAXLEN];
 int current_msg_len = 0;
+static bool msg_too_long = false;
+static uint32_t msg_start_gaps = 0;  // usart_rx_gaps() after the previous line
+
+// Only accessed from the main loop
+static queued_command_t command_queue[COMMAND_QUEUE_LEN];
+static uint8_t queue_head = 0;
+static uint8_t queue_count = 0;
+
+typedef struct {
+    const char* str;  // not null terminated
+    uint8_t len;
+} token_t;
+
+typedef struct {
+    token_t args[MAX_ARGS];
+    uint8_t num_args;
+    uint8_t next_arg;  // first argument not yet consumed
+    uint8_t output_num;  // set for MOT:<n> commands
+    char* response;
+    uint16_t resp_len;
+    uint16_t resp_max;
+} cmd_ctx_t;
+
+typedef struct {
+    const char* name;
+    uint8_t name_len;
+    void (*handler)(cmd_ctx_t* ctx);
+} command_t;
 
-static char* itoa(int value, char* string);
+#define COMMAND(name, handler) {name, sizeof(name) - 1, handler}
+#define NUM_COMMANDS(table) (sizeof(table) / sizeof(table[0]))
 
-static void append_str(char* dest, const char* src, int dest_max_len) {
-    strncat(dest, src, dest_max_len - strlen(dest));
+static void tokenize(const char* buf, cmd_ctx_t* ctx) {
+    // Split on ':' in a single pass, without modifying buf
+    const char* start = buf;
+    ctx->num_args = 0;
+    ctx->next_arg = 0;
+    for (const char* p = buf; ; p++) {
+        if (*p == ':' || *p == '\0') {
+            // arguments beyond MAX_ARGS are ignored
+            if (ctx->num_args < MAX_ARGS) {
+                ctx->args[ctx->num_args].str = start;
+                ctx->args[ctx->num_args].len = (uint8_t)(p - start);
+                ctx->num_args++;
+            }
+            if (*p == '\0') {
+                break;
+            }
+            start = p + 1;
+        }
+    }
 }
-static char* get_next_arg(char* response, const char* err_msg, int max_len) {
-    char* next_arg = strtok(NULL, ":");
-    if (next_arg == NULL) {
-        strncat(response, err_msg, max_len);
-        return NULL;
+
+static bool token_equals(const token_t* tok, const char* str, uint8_t len) {
+    return (tok->len == len) && (memcmp(tok->str, str, len) == 0);
+}
+
+static const command_t* find_command(const token_t* tok, const command_t* table, uint8_t table_len) {
+    // The length check rejects most entries without touching the string
+    for (uint8_t i = 0; i < table_len; i++) {
+        if (token_equals(tok, table[i].name, table[i].name_len)) {
+            return &table[i];
+        }
     }
-    return next_arg;
+    return NULL;
 }
 
-void process_received_data(char new_data) {
-    if (new_data == '\n') {
-        msg_buffer[current_msg_len] = '\0'; // add null terminator to make it a string
+uint16_t str_append(char* buf, uint16_t len, uint16_t max_len, const char* src) {
+    // Returns the new length, src is cut off at max_len and no terminator
+    // is written. Copy through locals, stores to buf could otherwise alias
+    // the caller's cursor.
+    char* dest = &buf[len];
+    const char* end = &buf[max_len];
+    while (*src != '\0' && dest < end) {
+        *dest++ = *src++;
+    }
+    return (uint16_t)(dest - buf);
+}
 
-        char response_buffer[USB_BUFFER_SIZE];
+static void append_str(cmd_ctx_t* ctx, const char* src) {
+    ctx->resp_len = str_append(ctx->response, ctx->resp_len, ctx->resp_max, src);
+}
 
-        handle_msg(msg_buffer, response_buffer, (USB_BUFFER_SIZE - 2));
-        current_msg_len = 0;
+static void append_token(cmd_ctx_t* ctx, const token_t* tok) {
+    uint16_t len = tok->len;
+    if (len > (ctx->resp_max - ctx->resp_len)) {
+        len = ctx->resp_max - ctx->resp_len;
+    }
+    memcpy(&ctx->response[ctx->resp_len], tok->str, len);
+    ctx->resp_len += len;
+}
 
-        uint16_t resp_len = strlen(response_buffer);
-        response_buffer[resp_len++] = '\n';
-        response_buffer[resp_len] = '\0';
-        usart_send_string(response_buffer);
-    } else if (new_data == '\r') {
-        // Drop carriage returns
-    } else {
-        msg_buffer[current_msg_len] = new_data;
-        current_msg_len++;
+static void append_int(cmd_ctx_t* ctx, int value) {
+    char temp_str[12];  // for doing itoa conversions
+    append_str(ctx, itoa(value, temp_str));
+}
 
-        // drop a full buffer without newlines
-        if (current_msg_len == (MSG_MAXLEN - 1)) {
-            current_msg_len = 0;
+static void append_field(cmd_ctx_t* ctx, int value) {
+    // :<value>, for every field after the first
+    append_str(ctx, ":");
+    append_int(ctx, value);
+}
+
+static void begin_line(cmd_ctx_t* line_ctx, char* line, uint16_t size) {
+    // Data lines sent ahead of a response are built in line with the
+    // append functions, leaving room for the newline added by end_line()
+    *line_ctx = (cmd_ctx_t){
+        .response = line,
+        .resp_len = 0,
+        .resp_max = size - 1,
+    };
+}
+
+static void end_line(cmd_ctx_t* line_ctx) {
+    line_ctx->response[line_ctx->resp_len++] = '\n';
+    usart_send((uint8_t*)line_ctx->response, line_ctx->resp_len);
+}
+
+static const token_t* get_next_arg(cmd_ctx_t* ctx, const char* err_msg) {
+    if (ctx->next_arg >= ctx->num_args) {
+        append_str(ctx, err_msg);
+        return NULL;
+    }
+    return &ctx->args[ctx->next_arg++];
+}
+
+static bool parse_int(const token_t* tok, int32_t min_val, int32_t max_val, int32_t* val) {
+    // The whole argument must be a decimal number within the bounds
+    uint8_t i = 0;
+    bool negative = (tok->len > 0 && tok->str[0] == '-');
+    // bounds the magnitude while parsing
+    int32_t limit = negative?-min_val:max_val;
+    int32_t result = 0;
+
+    if (negative) {
+        i++;
+    }
+    if (i == tok->len) {
+        return false;
+    }
+    for (; i < tok->len; i++) {
+        if (tok->str[i] < '0' || tok->str[i] > '9') {
+            return false;
+        }
+        result = (result * 10) + (tok->str[i] - '0');
+        // checked each digit so result can't overflow
+        if (result > limit) {
+            return false;
         }
     }
+    if (negative) {
+        result = -result;
+    }
+    if (result < min_val) {
+        return false;
+    }
+    *val = result;
+    return true;
 }
 
-void handle_msg(char* buf, char* response, int max_len) {
-    // max_len is the maximum length of the string that can be fitted in buf
-    // so the buffer must be at least max_len+1 long
-    char temp_str[12] = {0};  // for doing itoa conversions
-    response[0] = '\0';  // make a blank string
-
-    char* next_arg = strtok(buf, ":");
-    if (strcmp(next_arg, "MOT") == 0) {
-        next_arg = get_next_arg(response, "NACK:Missing motor number", max_len);
-        if(next_arg == NULL) {return;}
-
-        unsigned long int output_num;
-
-        if (isdigit((int)next_arg[0])) {
-            output_num = strtoul(next_arg, NULL, 10);
-            // bounds check
-            if (output_num >= 2) {
-                append_str(response, "NACK:Invalid motor number", max_len);
-                return;
-            }
-        } else {
-            append_str(response, "NACK:Missing motor number", max_len);
+static bool get_int_arg(cmd_ctx_t* ctx, const char* name, int32_t min_val, int32_t max_val, int32_t* val) {
+    // NACKs with "Missing <name>" or "Invalid <name>" on failure
+    if (ctx->next_arg >= ctx->num_args) {
+        append_str(ctx, "NACK:Missing ");
+        append_str(ctx, name);
+        return false;
+    }
+    if (!parse_int(&ctx->args[ctx->next_arg++], min_val, max_val, val)) {
+        append_str(ctx, "NACK:Invalid ");
+        append_str(ctx, name);
+        return false;
+    }
+    return true;
+}
+
+static void dispatch(cmd_ctx_t* ctx, const command_t* table, uint8_t table_len,
+                     const char* missing_msg, const char* unknown_msg) {
+    const token_t* next_arg = get_next_arg(ctx, missing_msg);
+    if(next_arg == NULL) {return;}
+
+    const command_t* cmd = find_command(next_arg, table, table_len);
+    if (cmd == NULL) {
+        append_str(ctx, unknown_msg);
+        return;
+    }
+    cmd->handler(ctx);
+}
+
+static void motor_set(cmd_ctx_t* ctx) {
+    int32_t output_val;
+    if (!get_int_arg(ctx, "motor power", MIN_MOTOR_VAL, MAX_MOTOR_VAL, &output_val)) {return;}
+
+    if (output_inhibited(ctx->output_num)) {
+        append_str(ctx, "NACK:Output latched off");
+        return;
+    }
+
+    // Set motor power, taking over from any trajectory
+    traj_stop();
+    torque_release(ctx->output_num);
+    ramp_set_target(ctx->output_num, (int16_t)output_val);
+
+    append_str(ctx, "ACK");
+}
+
+static void motor_get(cmd_ctx_t* ctx) {
+    // Get motor value
+    append_str(ctx, output_enabled(ctx->output_num)?"1":"0");
+    append_str(ctx, ":");
+    append_int(ctx, output_get_output(ctx->output_num));
+}
+
+static void motor_disable(cmd_ctx_t* ctx) {
+    // Disable motor
+    traj_stop();
+    torque_release(ctx->output_num);
+    ramp_stop(ctx->output_num);
+    output_disable(ctx->output_num);
+
+    append_str(ctx, "ACK");
+}
+
+static void motor_get_current(cmd_ctx_t* ctx) {
+    append_int(ctx, output_get_current(ctx->output_num));
+}
+
+static void motor_set_current(cmd_ctx_t* ctx) {
+    int32_t target;
+    if (!get_int_arg(ctx, "motor current", -TORQUE_MAX_CURRENT, TORQUE_MAX_CURRENT, &target)) {return;}
+
+    if (output_inhibited(ctx->output_num)) {
+        append_str(ctx, "NACK:Output latched off");
+        return;
+    }
+
+    // Regulate the motor current from the ADC interrupt
+    traj_stop();
+    ramp_stop(ctx->output_num);
+    torque_set_target(ctx->output_num, (int16_t)target);
+
+    append_str(ctx, "ACK");
+}
+
+static void motor_get_current_target(cmd_ctx_t* ctx) {
+    append_str(ctx, torque_active(ctx->output_num)?"1":"0");
+    append_str(ctx, ":");
+    append_int(ctx, torque_get_target(ctx->output_num));
+}
+
+static void motor_set_gain(cmd_ctx_t* ctx) {
+    int32_t kp, ki;
+    if (!get_int_arg(ctx, "gain", 0, UINT16_MAX, &kp)) {return;}
+    if (!get_int_arg(ctx, "gain", 0, UINT16_MAX, &ki)) {return;}
+
+    torque_set_gains(ctx->output_num, (uint16_t)kp, (uint16_t)ki);
+
+    append_str(ctx, "ACK");
+}
+
+static void motor_get_gain(cmd_ctx_t* ctx) {
+    append_int(ctx, torque_get_kp(ctx->output_num));
+    append_str(ctx, ":");
+    append_int(ctx, torque_get_ki(ctx->output_num));
+}
+
+static void motor_set_ramp(cmd_ctx_t* ctx) {
+    int32_t accel, decel;
+    if (!get_int_arg(ctx, "ramp rate", 0, UINT16_MAX, &accel)) {return;}
+    if (!get_int_arg(ctx, "ramp rate", 0, UINT16_MAX, &decel)) {return;}
+
+    ramp_set_limits(ctx->output_num, (uint16_t)accel, (uint16_t)decel);
+
+    append_str(ctx, "ACK");
+}
+
+static void motor_get_ramp(cmd_ctx_t* ctx) {
+    append_int(ctx, ramp_get_accel(ctx->output_num));
+    append_str(ctx, ":");
+    append_int(ctx, ramp_get_decel(ctx->output_num));
+}
+
+static void motor_set_filter(cmd_ctx_t* ctx) {
+    int32_t cutoff, stages;
+    if (!get_int_arg(ctx, "filter cutoff", 0, CURRENT_FILTER_MAX_CUTOFF, &cutoff)) {return;}
+    if (!get_int_arg(ctx, "filter stages", 1, CURRENT_FILTER_MAX_STAGES, &stages)) {return;}
+
+    analogue_set_filter(ctx->output_num, (uint16_t)cutoff, (uint8_t)stages);
+
+    append_str(ctx, "ACK");
+}
+
+static void motor_get_filter(cmd_ctx_t* ctx) {
+    append_int(ctx, analogue_get_filter_cutoff(ctx->output_num));
+    append_str(ctx, ":");
+    append_int(ctx, analogue_get_filter_stages(ctx->output_num));
+}
+
+static const char* const ilimit_policy_names[ILIMIT_NUM_POLICIES] = {
+    [ILIMIT_CUT] = "CUT",
+    [ILIMIT_FOLD] = "FOLD",
+    [ILIMIT_LATCH] = "LATCH",
+};
+
+static void motor_set_ilimit(cmd_ctx_t* ctx) {
+    int32_t limit;
+    if (!get_int_arg(ctx, "current limit", 0, ILIMIT_MAX_CURRENT, &limit)) {return;}
+
+    const token_t* next_arg = get_next_arg(ctx, "NACK:Missing limit policy");
+    if(next_arg == NULL) {return;}
+    uint8_t policy = 0;
+    while (policy < ILIMIT_NUM_POLICIES && !token_equals(next_arg, ilimit_policy_names[policy], strlen(ilimit_policy_names[policy]))) {
+        policy++;
+    }
+    if (policy == ILIMIT_NUM_POLICIES) {
+        append_str(ctx, "NACK:Invalid limit policy");
+        return;
+    }
+
+    ilimit_set(ctx->output_num, (uint16_t)limit, (ilimit_policy_t)policy);
+
+    append_str(ctx, "ACK");
+}
+
+static void motor_get_ilimit(cmd_ctx_t* ctx) {
+    append_int(ctx, ilimit_get_limit(ctx->output_num));
+    append_str(ctx, ":");
+    append_str(ctx, ilimit_policy_names[ilimit_get_policy(ctx->output_num)]);
+    append_str(ctx, ":");
+    append_int(ctx, (int)ilimit_get_trips(ctx->output_num));
+}
+
+static void all_outputs_set(cmd_ctx_t* ctx) {
+    // MOT:ALL:SET:<value 0>:<value 1> sets every output on the same PWM edge
+    int32_t output_vals[NUM_OUTPUTS];
+    for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+        if (!get_int_arg(ctx, "motor power", MIN_MOTOR_VAL, MAX_MOTOR_VAL, &output_vals[i])) {return;}
+    }
+    for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+        if (output_inhibited(i)) {
+            append_str(ctx, "NACK:Output latched off");
             return;
         }
+    }
 
-        next_arg = get_next_arg(response, "NACK:Missing motor command", max_len);
-        if(next_arg == NULL) {return;}
+    traj_stop();
+    for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+        torque_release(i);
+        ramp_stage_target(i, (int16_t)output_vals[i]);
+    }
+    output_commit();
 
-        if (strcmp(next_arg, "SET") == 0) {
-            next_arg = get_next_arg(response, "NACK:Missing motor power", max_len);
-            if(next_arg == NULL) {return;}
-            if (!(isdigit((int)next_arg[0]) || (next_arg[0] == '-'))) {
-                append_str(response, "NACK:Invalid motor power", max_len);
-                return;
-            }
+    append_str(ctx, "ACK");
+}
 
-            long int output_val = strtol(next_arg, NULL, 10);
+static void append_energy(cmd_ctx_t* ctx, const energy_reading_t* reading) {
+    // <charge>:<energy>, in uAh and uWh, itoa is signed
+    append_int(ctx, (int)((reading->charge_uah > INT32_MAX)?(INT32_MAX):(reading->charge_uah)));
+    append_str(ctx, ":");
+    append_int(ctx, (int)((reading->energy_uwh > INT32_MAX)?(INT32_MAX):(reading->energy_uwh)));
+}
 
-            // bounds check
-            if (output_val < MIN_MOTOR_VAL || output_val > MAX_MOTOR_VAL) {
-                append_str(response, "NACK:Invalid motor power", max_len);
-                return;
-            }
-            // Set motor power
-            output_set_power((uint8_t) output_num, (int16_t) output_val);
+static void motor_get_energy(cmd_ctx_t* ctx) {
+    energy_reading_t reading;
+    energy_get_output(ctx->output_num, &reading);
+    append_energy(ctx, &reading);
+}
 
-            append_str(response, "ACK", max_len);
-            return;
-        } else if (strcmp(next_arg, "GET?") == 0) {
-            // Get motor value
-            append_str(response, output_enabled((uint8_t)output_num)?"1":"0", max_len);
-            append_str(response, ":", max_len);
-            append_str(response, itoa(output_get_output((uint8_t)output_num), temp_str), max_len);
-            return;
-        } else if (strcmp(next_arg, "DISABLE") == 0) {
-            // Disable motor
-            output_disable((uint8_t)output_num);
+static const command_t motor_commands[] = {
+    COMMAND("SET", motor_set),
+    COMMAND("GET?", motor_get),
+    COMMAND("I?", motor_get_current),
+    COMMAND("DISABLE", motor_disable),
+    COMMAND("ISET", motor_set_current),
+    COMMAND("ISET?", motor_get_current_target),
+    COMMAND("GAIN", motor_set_gain),
+    COMMAND("GAIN?", motor_get_gain),
+    COMMAND("RAMP", motor_set_ramp),
+    COMMAND("RAMP?", motor_get_ramp),
+    COMMAND("FILT", motor_set_filter),
+    COMMAND("FILT?", motor_get_filter),
+    COMMAND("ENERGY?", motor_get_energy),
+    COMMAND("ILIM", motor_set_ilimit),
+    COMMAND("ILIM?", motor_get_ilimit),
+};
 
-            append_str(response, "ACK", max_len);
-            return;
-        } else if (strcmp(next_arg, "I?") == 0) {
-            append_str(response, itoa(output_get_current((uint8_t)output_num), temp_str), max_len);
-            return;
-        } else {
-            append_str(response, "NACK:Unknown motor command", max_len);
+static const command_t all_outputs_commands[] = {
+    COMMAND("SET", all_outputs_set),
+};
+
+static void handle_motor(cmd_ctx_t* ctx) {
+    if (ctx->next_arg < ctx->num_args && token_equals(&ctx->args[ctx->next_arg], "ALL", 3)) {
+        ctx->next_arg++;
+        dispatch(ctx, all_outputs_commands, NUM_COMMANDS(all_outputs_commands),
+                 "NACK:Missing motor command", "NACK:Unknown motor command");
+        return;
+    }
+
+    int32_t output_num;
+    if (!get_int_arg(ctx, "motor number", 0, NUM_OUTPUTS - 1, &output_num)) {return;}
+    ctx->output_num = (uint8_t)output_num;
+
+    dispatch(ctx, motor_commands, NUM_COMMANDS(motor_commands),
+             "NACK:Missing motor command", "NACK:Unknown motor command");
+}
+
+static void send_capture_data(void) {
+    // Each sample is 3 12-bit ADC codes (M0 CS, M1 CS, 12V) as 3 hex digits each
+    static const char hex_digits[] = "0123456789ABCDEF";
+    char line[(CAPTURE_SAMPLES_PER_LINE * 9) + 2];
+    uint8_t line_len = 0;
+    capture_sample_t sample;
+
+    for (uint16_t i = 0; capture_read(i, &sample); i++) {
+        uint16_t codes[3] = {sample.m0_current, sample.m1_current, sample.voltage};
+        for (uint8_t j = 0; j < 3; j++) {
+            line[line_len++] = hex_digits[(codes[j] >> 8) & 0xf];
+            line[line_len++] = hex_digits[(codes[j] >> 4) & 0xf];
+            line[line_len++] = hex_digits[codes[j] & 0xf];
+        }
+        if (line_len == (CAPTURE_SAMPLES_PER_LINE * 9)) {
+            line[line_len++] = '\n';
+            usart_send((uint8_t*)line, line_len);
+            line_len = 0;
+        }
+    }
+    if (line_len != 0) {
+        line[line_len++] = '\n';
+        usart_send((uint8_t*)line, line_len);
+    }
+}
+
+static void capture_trigger(cmd_ctx_t* ctx) {
+    // Indexed by capture_trigger_t
+    static const char* const trigger_names[] = {"NONE", "M0", "M1", "FAULT"};
+    const uint8_t num_sources = sizeof(trigger_names) / sizeof(trigger_names[0]);
+
+    const token_t* next_arg = get_next_arg(ctx, "NACK:Missing trigger source");
+    if(next_arg == NULL) {return;}
+
+    uint8_t source = 0;
+    while (source < num_sources && !token_equals(next_arg, trigger_names[source], strlen(trigger_names[source]))) {
+        source++;
+    }
+    if (source == num_sources) {
+        append_str(ctx, "NACK:Invalid trigger source");
+        return;
+    }
+
+    uint16_t threshold = 0;
+    if (source == CAPTURE_TRIG_M0 || source == CAPTURE_TRIG_M1) {
+        int32_t val;
+        if (!get_int_arg(ctx, "trigger threshold", 0, UINT16_MAX, &val)) {return;}
+        threshold = analogue_ma_to_raw((uint16_t)val);
+    }
+    capture_set_trigger((capture_trigger_t)source, threshold);
+
+    append_str(ctx, "ACK");
+}
+
+static void capture_start(cmd_ctx_t* ctx) {
+    int32_t decimation, pre_trigger;
+    if (!get_int_arg(ctx, "decimation", 1, UINT8_MAX, &decimation)) {return;}
+    if (!get_int_arg(ctx, "pre-trigger length", 0, CAPTURE_DEPTH - 1, &pre_trigger)) {return;}
+
+    capture_arm((uint8_t)decimation, (uint16_t)pre_trigger);
+
+    append_str(ctx, "ACK");
+}
+
+static void capture_halt(cmd_ctx_t* ctx) {
+    capture_stop();
+
+    append_str(ctx, "ACK");
+}
+
+static void capture_get_status(cmd_ctx_t* ctx) {
+    static const char* const state_names[] = {"IDLE", "ARMED", "TRIGGERED", "DONE"};
+    append_str(ctx, state_names[capture_get_state()]);
+    append_str(ctx, ":");
+    append_int(ctx, capture_get_count());
+}
+
+static void capture_dump(cmd_ctx_t* ctx) {
+    if (capture_get_state() != CAPTURE_DONE) {
+        append_str(ctx, "NACK:Capture not complete");
+        return;
+    }
+    // The data lines are followed by this response
+    send_capture_data();
+
+    append_int(ctx, capture_get_count());
+    append_str(ctx, ":");
+    append_int(ctx, capture_get_decimation());
+    append_str(ctx, ":");
+    append_int(ctx, capture_get_pre_trigger());
+}
+
+static const command_t capture_commands[] = {
+    COMMAND("TRIG", capture_trigger),
+    COMMAND("ARM", capture_start),
+    COMMAND("STOP", capture_halt),
+    COMMAND("STATE?", capture_get_status),
+    COMMAND("READ?", capture_dump),
+};
+
+static void handle_capture(cmd_ctx_t* ctx) {
+    dispatch(ctx, capture_commands, NUM_COMMANDS(capture_commands),
+             "NACK:Missing capture command", "NACK:Unknown capture command");
+}
+
+static void sys_bootloader(cmd_ctx_t* ctx) {
+    // enter bootloader after sending ack
+    enter_bootloader_next_cycle();
+
+    append_str(ctx, "ACK\n\n");
+}
+
+static void sys_binary(cmd_ctx_t* ctx) {
+    // switch to framed binary commands after this ACK
+    bin_mode_enter();
+
+    append_str(ctx, "ACK");
+}
+
+static void sys_baud(cmd_ctx_t* ctx) {
+    if (ctx->next_arg < ctx->num_args && token_equals(&ctx->args[ctx->next_arg], "CONFIRM", 7)) {
+        ctx->next_arg++;
+        // keep the new rate, answered at that rate
+        if (!usart_confirm_baud()) {
+            append_str(ctx, "NACK:No baud rate change to confirm");
             return;
         }
-    } else if (strcmp(next_arg, "*IDN?") == 0) {
-        // Identifier string: manufacturer, board name, asset tag, version
-        append_str(response, "Student Robotics:" BOARD_NAME_SHORT ":", max_len);
-        append_str(response, serialnum, max_len);
-        append_str(response, ":" FW_VER, max_len);
+        append_str(ctx, "ACK");
         return;
-    } else if (strcmp(next_arg, "*STATUS?") == 0) {
-        append_str(response, (output_data[0].in_fault)?"1":"0", max_len);
-        append_str(response, ",", max_len);
-        append_str(response, (output_data[1].in_fault)?"1":"0", max_len);
-        append_str(response, ":", max_len);
-        append_str(response, itoa(input_voltage, temp_str), max_len);
+    }
+
+    int32_t baud;
+    if (ctx->next_arg >= ctx->num_args) {
+        // the stored rate, only switched to when the host asks for it
+        baud = config_get(CONFIG_BAUD);
+    } else if (!get_int_arg(ctx, "baud rate", 0, INT32_MAX, &baud)) {
+        return;
+    }
+    if (!usart_baud_supported((uint32_t)baud)) {
+        append_str(ctx, "NACK:Unsupported baud rate");
         return;
-    } else if (strcmp(next_arg, "*RESET") == 0) {
-        outputs_reset();
+    }
+    // switch after this ACK is sent, reverts unless confirmed
+    usart_change_baud((uint32_t)baud, true);
+
+    append_str(ctx, "ACK");
+}
+
+static void sys_get_baud(cmd_ctx_t* ctx) {
+    append_int(ctx, (int)usart_get_baud());
+}
+
+static const command_t sys_commands[] = {
+    COMMAND("BOOTLOADER", sys_bootloader),
+    COMMAND("BINARY", sys_binary),
+    COMMAND("BAUD", sys_baud),
+    COMMAND("BAUD?", sys_get_baud),
+};
+
+static void handle_sys(cmd_ctx_t* ctx) {
+    dispatch(ctx, sys_commands, NUM_COMMANDS(sys_commands),
+             "NACK:Missing system command", "NACK:Invalid system command");
+}
+
+static void handle_idn(cmd_ctx_t* ctx) {
+    // Identifier string: manufacturer, board name, asset tag, version
+    append_str(ctx, "Student Robotics:" BOARD_NAME_SHORT ":");
+    append_str(ctx, serialnum);
+    append_str(ctx, ":" FW_VER);
+}
+
+static void handle_status(cmd_ctx_t* ctx) {
+    append_str(ctx, (output_data[0].in_fault)?"1":"0");
+    append_str(ctx, ",");
+    append_str(ctx, (output_data[1].in_fault)?"1":"0");
+    append_str(ctx, ":");
+    append_int(ctx, input_voltage);
+}
+
+static void handle_snapshot(cmd_ctx_t* ctx) {
+    // <sample>:<enabled 0>,<enabled 1>:<value 0>,<value 1>:<current 0>,<current 1>:<fault 0>,<fault 1>:<input voltage>
+    telemetry_snapshot_t snapshot;
+    telemetry_snapshot(&snapshot);
 
-        append_str(response, "ACK", max_len);
+    // itoa is signed, the counter wraps at 2^31
+    append_int(ctx, (int)(snapshot.sample & INT32_MAX));
+    for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+        append_str(ctx, (i == 0)?":":",");
+        append_str(ctx, (snapshot.outputs[i].enabled)?"1":"0");
+    }
+    for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+        append_str(ctx, (i == 0)?":":",");
+        append_int(ctx, snapshot.outputs[i].value);
+    }
+    for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+        append_str(ctx, (i == 0)?":":",");
+        append_int(ctx, snapshot.outputs[i].current);
+    }
+    for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+        append_str(ctx, (i == 0)?":":",");
+        append_str(ctx, (snapshot.outputs[i].in_fault)?"1":"0");
+    }
+    append_str(ctx, ":");
+    append_int(ctx, snapshot.input_voltage);
+}
+
+static void handle_get_energy(cmd_ctx_t* ctx) {
+    energy_reading_t reading;
+    energy_get_total(&reading);
+    append_energy(ctx, &reading);
+}
+
+static void energy_clear(cmd_ctx_t* ctx) {
+    energy_reset();
+
+    append_str(ctx, "ACK");
+}
+
+static const command_t energy_commands[] = {
+    COMMAND("RESET", energy_clear),
+};
+
+static void handle_energy(cmd_ctx_t* ctx) {
+    dispatch(ctx, energy_commands, NUM_COMMANDS(energy_commands),
+             "NACK:Missing energy command", "NACK:Unknown energy command");
+}
+
+static void handle_get_telemetry(cmd_ctx_t* ctx) {
+    append_int(ctx, telemetry_get_rate());
+}
+
+static void handle_set_telemetry(cmd_ctx_t* ctx) {
+    int32_t rate;
+    if (!get_int_arg(ctx, "telemetry rate", 0, TELEMETRY_MAX_RATE, &rate)) {return;}
+
+    telemetry_set_rate((uint16_t)rate);
+
+    append_str(ctx, "ACK");
+}
+
+static void handle_set_pwm(cmd_ctx_t* ctx) {
+    int32_t freq;
+    if (!get_int_arg(ctx, "PWM frequency", 0, UINT16_MAX, &freq)) {return;}
+
+    // applied at the next PWM period
+    if (!output_set_pwm_frequency((uint16_t)freq)) {
+        append_str(ctx, "NACK:Invalid PWM frequency");
         return;
-    } else if (strcmp(next_arg, "*SYS") == 0) {
-        next_arg = get_next_arg(response, "NACK:Missing system command", max_len);
-        if(next_arg == NULL) {return;}
+    }
+    // scans synced to the PWM change rate with it
+    analogue_update_filters();
 
-        if (strcmp(next_arg, "BOOTLOADER") == 0) {
-            // enter bootloader after sending ack
-            enter_bootloader_next_cycle();
+    append_str(ctx, "ACK");
+}
 
-            append_str(response, "ACK\n\n", max_len);
-            return;
+static void handle_get_pwm(cmd_ctx_t* ctx) {
+    append_int(ctx, output_get_pwm_frequency());
+    append_str(ctx, ":");
+    append_int(ctx, output_get_pwm_resolution());
+}
+
+static void adc_sync(cmd_ctx_t* ctx) {
+    int32_t phase;
+    if (!get_int_arg(ctx, "sample phase", 0, 999, &phase)) {return;}
+
+    analogue_sync_to_pwm((uint16_t)phase);
+
+    append_str(ctx, "ACK");
+}
+
+static void adc_free(cmd_ctx_t* ctx) {
+    analogue_free_run();
+
+    append_str(ctx, "ACK");
+}
+
+static const command_t adc_commands[] = {
+    COMMAND("SYNC", adc_sync),
+    COMMAND("FREE", adc_free),
+};
+
+static void handle_adc(cmd_ctx_t* ctx) {
+    dispatch(ctx, adc_commands, NUM_COMMANDS(adc_commands),
+             "NACK:Missing ADC command", "NACK:Unknown ADC command");
+}
+
+static void handle_get_adc(cmd_ctx_t* ctx) {
+    append_str(ctx, analogue_synced()?"SYNC":"FREE");
+    append_str(ctx, ":");
+    append_int(ctx, output_get_trigger_phase());
+    append_str(ctx, ":");
+    append_int(ctx, (int)analogue_sample_rate());
+}
+
+static void handle_reset(cmd_ctx_t* ctx) {
+    traj_abort();
+    torque_reset();
+    ramp_reset();
+    outputs_reset();
+    ilimit_reset();
+    telemetry_set_rate(0);
+    // back to the default rate after this ACK, cancelling a change
+    // that hasn't been applied or confirmed yet
+    usart_reset_baud();
+
+    append_str(ctx, "ACK");
+}
+
+static void send_timing_line(const char* name, stats_timing_id_t id) {
+    // <name>:<min>:<max>:<mean>:<count>, in CPU cycles
+    char line[USART_TX_SLOT_SIZE];
+    cmd_ctx_t line_ctx;
+    stats_timing_t timing;
+    stats_get_timing(id, &timing);
+
+    begin_line(&line_ctx, line, sizeof(line));
+    append_str(&line_ctx, name);
+    append_field(&line_ctx, (int)timing.min);
+    append_field(&line_ctx, (int)timing.max);
+    append_field(&line_ctx, (timing.count != 0)?(int)(timing.total / timing.count):0);
+    append_field(&line_ctx, (int)timing.count);
+    end_line(&line_ctx);
+}
+
+static void handle_get_stats(cmd_ctx_t* ctx) {
+    // The timing lines are followed by this response
+    send_timing_line("ADC", STATS_ADC_ISR);
+    send_timing_line("CMD", STATS_COMMAND);
+    send_timing_line("TX", STATS_USART_TX);
+
+    // <ADC overruns>:<USART overrun>,<framing>,<noise>,<rx full>:<idle %>
+    append_int(ctx, (int)stats_get_adc_overruns());
+    append_str(ctx, ":");
+    append_int(ctx, (int)usart_errors.overrun);
+    append_str(ctx, ",");
+    append_int(ctx, (int)usart_errors.framing);
+    append_str(ctx, ",");
+    append_int(ctx, (int)usart_errors.noise);
+    append_str(ctx, ",");
+    append_int(ctx, (int)usart_errors.rx_full);
+    append_str(ctx, ":");
+    append_int(ctx, stats_get_idle_percent());
+}
+
+static void stats_clear(cmd_ctx_t* ctx) {
+    stats_reset();
+    sched_reset_stats();
+
+    append_str(ctx, "ACK");
+}
+
+static const command_t stats_commands[] = {
+    COMMAND("RESET", stats_clear),
+};
+
+static void handle_stats(cmd_ctx_t* ctx) {
+    dispatch(ctx, stats_commands, NUM_COMMANDS(stats_commands),
+             "NACK:Missing stats command", "NACK:Unknown stats command");
+}
+
+static const char* const sched_task_names[SCHED_NUM_TASKS] = {
+    [SCHED_FAULTS] = "FAULTS",
+    [SCHED_TELEMETRY] = "TELEM",
+    [SCHED_MONITOR] = "MONITOR",
+};
+
+static void handle_get_sched(cmd_ctx_t* ctx) {
+    // <name>:<period ms>:<runs>:<overruns>:<max cycles> for each task,
+    // in priority order, then the total overruns as the response
+    uint32_t total_overruns = 0;
+    for (uint8_t i = 0; i < SCHED_NUM_TASKS; i++) {
+        char line[USART_TX_SLOT_SIZE];
+        cmd_ctx_t line_ctx;
+        sched_task_stats_t stats;
+        sched_get_stats(i, &stats);
+        total_overruns += stats.overruns;
+
+        begin_line(&line_ctx, line, sizeof(line));
+        append_str(&line_ctx, sched_task_names[i]);
+        append_field(&line_ctx, stats.period_ms);
+        append_field(&line_ctx, (int)stats.runs);
+        append_field(&line_ctx, (int)stats.overruns);
+        append_field(&line_ctx, (int)stats.max_cycles);
+        end_line(&line_ctx);
+    }
+
+    append_int(ctx, (int)total_overruns);
+}
+
+static const char* const event_names[EVENT_NUM_TYPES] = {
+    [EVENT_RESET] = "RESET",
+    [EVENT_FAULT] = "FAULT",
+    [EVENT_FAULT_CLEAR] = "FAULT_CLEAR",
+    [EVENT_OVERCURRENT] = "OVERCURRENT",
+    [EVENT_UNDERVOLTAGE] = "UNDERVOLTAGE",
+    [EVENT_VOLTAGE_OK] = "VOLTAGE_OK",
+    [EVENT_COMMAND_ERROR] = "COMMAND_ERROR",
+};
+
+static void send_event_line(const eventlog_entry_t* entry) {
+    // <boot>:<time>:<event>:<arg>:<value>
+    char line[USART_TX_SLOT_SIZE];
+    cmd_ctx_t line_ctx;
+
+    begin_line(&line_ctx, line, sizeof(line));
+    append_str(&line_ctx, entry->previous_boot?"1":"0");
+    append_field(&line_ctx, (int)entry->time);
+    append_str(&line_ctx, ":");
+    append_str(&line_ctx, event_names[entry->type]);
+    append_field(&line_ctx, entry->arg);
+    append_field(&line_ctx, entry->value);
+    end_line(&line_ctx);
+}
+
+static void handle_get_log(cmd_ctx_t* ctx) {
+    // The entries, oldest first, are followed by this response
+    uint8_t sent = 0;
+    eventlog_entry_t entry;
+    while (eventlog_get(sent, &entry)) {
+        send_event_line(&entry);
+        sent++;
+    }
+
+    // <entries>:<dropped>
+    append_int(ctx, sent);
+    append_str(ctx, ":");
+    append_int(ctx, (int)eventlog_dropped());
+}
+
+static void log_clear(cmd_ctx_t* ctx) {
+    eventlog_clear();
+
+    append_str(ctx, "ACK");
+}
+
+static const command_t log_commands[] = {
+    COMMAND("CLEAR", log_clear),
+};
+
+static void handle_log(cmd_ctx_t* ctx) {
+    dispatch(ctx, log_commands, NUM_COMMANDS(log_commands),
+             "NACK:Missing log command", "NACK:Unknown log command");
+}
+
+static void traj_add_entries(cmd_ctx_t* ctx) {
+    // TRAJ:ADD:<time>:<output>:<value>[:<time>:<output>:<value>...], as
+    // many entries as fit in the arguments
+    traj_entry_t entries[MAX_ARGS / 3];
+    uint8_t count = 0;
+    do {
+        int32_t time_us, output_num, value;
+        if (!get_int_arg(ctx, "entry time", 0, TRAJ_MAX_TIME, &time_us)) {return;}
+        if (!get_int_arg(ctx, "motor number", 0, NUM_OUTPUTS - 1, &output_num)) {return;}
+        if (!get_int_arg(ctx, "motor power", MIN_MOTOR_VAL, MAX_MOTOR_VAL, &value)) {return;}
+        entries[count++] = (traj_entry_t){
+            .time_us = (uint32_t)time_us,
+            .output_num = (uint8_t)output_num,
+            .value = (int16_t)value,
+        };
+    } while (ctx->next_arg < ctx->num_args && count < (MAX_ARGS / 3));
+
+    traj_status_t status;
+    traj_get_status(&status);
+    if (status.state == TRAJ_DONE) {
+        // the queue ran dry, these would wait for another start
+        append_str(ctx, "NACK:Trajectory done");
+        return;
+    }
+    if (count > traj_free()) {
+        append_str(ctx, "NACK:Trajectory buffer full");
+        return;
+    }
+    if (!traj_add(entries, count)) {
+        // playback may have run out since the check above
+        traj_get_status(&status);
+        append_str(ctx, (status.state == TRAJ_DONE)?("NACK:Trajectory done"):("NACK:Entries out of order"));
+        return;
+    }
+
+    append_str(ctx, "ACK");
+}
+
+static void traj_start_playback(cmd_ctx_t* ctx) {
+    traj_status_t status;
+    traj_get_status(&status);
+    if (status.state == TRAJ_RUNNING) {
+        append_str(ctx, "NACK:Trajectory running");
+        return;
+    }
+    if (!traj_start()) {
+        append_str(ctx, "NACK:Trajectory empty");
+        return;
+    }
+
+    append_str(ctx, "ACK");
+}
+
+static void traj_abort_playback(cmd_ctx_t* ctx) {
+    traj_abort();
+
+    append_str(ctx, "ACK");
+}
+
+static const command_t traj_commands[] = {
+    COMMAND("ADD", traj_add_entries),
+    COMMAND("START", traj_start_playback),
+    COMMAND("ABORT", traj_abort_playback),
+};
+
+static void handle_traj(cmd_ctx_t* ctx) {
+    dispatch(ctx, traj_commands, NUM_COMMANDS(traj_commands),
+             "NACK:Missing trajectory command", "NACK:Unknown trajectory command");
+}
+
+static const char* const traj_state_names[TRAJ_NUM_STATES] = {
+    [TRAJ_IDLE] = "IDLE",
+    [TRAJ_RUNNING] = "RUNNING",
+    [TRAJ_DONE] = "DONE",
+};
+
+static void handle_get_traj(cmd_ctx_t* ctx) {
+    // <state>:<played>:<queued>:<free>:<elapsed ms>:<max late us>
+    traj_status_t status;
+    traj_get_status(&status);
+
+    append_str(ctx, traj_state_names[status.state]);
+    append_str(ctx, ":");
+    append_int(ctx, (int)(status.played & INT32_MAX));
+    append_str(ctx, ":");
+    append_int(ctx, status.queued);
+    append_str(ctx, ":");
+    append_int(ctx, traj_free());
+    append_str(ctx, ":");
+    append_int(ctx, (int)(status.elapsed_us / 1000));
+    append_str(ctx, ":");
+    append_int(ctx, (int)(status.max_late_us & INT32_MAX));
+}
+
+static const char* const config_key_names[CONFIG_NUM_KEYS] = {
+    [CONFIG_CURRENT_SCALE] = "ISCALE",
+    [CONFIG_VOLTAGE_SCALE] = "VSCALE",
+    [CONFIG_LED_CURRENT] = "LED",
+    [CONFIG_FILTER_CUTOFF] = "FILT",
+    [CONFIG_FILTER_STAGES] = "STAGES",
+    [CONFIG_PWM_FREQUENCY] = "PWM",
+    [CONFIG_BAUD] = "BAUD",
+};
+
+static bool get_config_key(cmd_ctx_t* ctx, config_key_t* key) {
+    const token_t* next_arg = get_next_arg(ctx, "NACK:Missing config key");
+    if(next_arg == NULL) {return false;}
+    uint8_t i = 0;
+    while (i < CONFIG_NUM_KEYS && !token_equals(next_arg, config_key_names[i], strlen(config_key_names[i]))) {
+        i++;
+    }
+    if (i == CONFIG_NUM_KEYS) {
+        append_str(ctx, "NACK:Unknown config key");
+        return false;
+    }
+    *key = (config_key_t)i;
+    return true;
+}
+
+static bool outputs_disabled(cmd_ctx_t* ctx) {
+    // Writing flash stalls the interrupts, so the motors must be stopped
+    for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+        if (output_enabled(i)) {
+            append_str(ctx, "NACK:Outputs must be disabled");
+            return false;
         }
+    }
+    return true;
+}
+
+static void cfg_get(cmd_ctx_t* ctx) {
+    config_key_t key;
+    if (!get_config_key(ctx, &key)) {return;}
+
+    append_int(ctx, (int)config_get(key));
+}
+
+static void cfg_set(cmd_ctx_t* ctx) {
+    config_key_t key;
+    if (!get_config_key(ctx, &key)) {return;}
+    int32_t value;
+    if (!get_int_arg(ctx, "config value", -INT32_MAX, INT32_MAX, &value)) {return;}
 
-        append_str(response, "NACK:Invalid system command", max_len);
+    if (!config_set(key, value)) {
+        append_str(ctx, "NACK:Invalid config value");
         return;
-    } else if (strcmp(next_arg, "ECHO") == 0) {
-        next_arg = strtok(NULL, ":");
+    }
+
+    append_str(ctx, "ACK");
+}
 
-        append_str(response, next_arg, max_len);
+static void cfg_commit(cmd_ctx_t* ctx) {
+    if (!outputs_disabled(ctx)) {return;}
+
+    if (!config_commit()) {
+        append_str(ctx, "NACK:Flash write failed");
         return;
-    } else {
-        append_str(response, "NACK:Unknown command: '", max_len);
-        append_str(response, next_arg, max_len);
-        append_str(response, "'", max_len);
+    }
+
+    append_str(ctx, "ACK");
+}
+
+static void cfg_factory(cmd_ctx_t* ctx) {
+    if (!outputs_disabled(ctx)) {return;}
+
+    if (!config_factory_reset()) {
+        append_str(ctx, "NACK:Flash write failed");
         return;
     }
 
-    // This should be unreachable
-    append_str(response, "NACK:Unknown error", max_len);
-    return;
+    append_str(ctx, "ACK");
+}
+
+static const command_t config_commands[] = {
+    COMMAND("GET", cfg_get),
+    COMMAND("SET", cfg_set),
+    COMMAND("COMMIT", cfg_commit),
+    COMMAND("FACTORY", cfg_factory),
+};
+
+static void handle_config(cmd_ctx_t* ctx) {
+    dispatch(ctx, config_commands, NUM_COMMANDS(config_commands),
+             "NACK:Missing config command", "NACK:Unknown config command");
+}
+
+static void handle_get_config(cmd_ctx_t* ctx) {
+    // <key>:<value> for each key, then
+    // <pending>:<records>:<free records>:<sequence> as the response
+    for (uint8_t i = 0; i < CONFIG_NUM_KEYS; i++) {
+        char line[USART_TX_SLOT_SIZE];
+        cmd_ctx_t line_ctx;
+        begin_line(&line_ctx, line, sizeof(line));
+        append_str(&line_ctx, config_key_names[i]);
+        append_field(&line_ctx, (int)config_get((config_key_t)i));
+        end_line(&line_ctx);
+    }
+
+    config_status_t status;
+    config_get_status(&status);
+    append_int(ctx, status.pending);
+    append_str(ctx, ":");
+    append_int(ctx, status.records);
+    append_str(ctx, ":");
+    append_int(ctx, status.free_records);
+    append_str(ctx, ":");
+    append_int(ctx, (int)(status.sequence & INT32_MAX));
+}
+
+static void handle_echo(cmd_ctx_t* ctx) {
+    if (ctx->next_arg < ctx->num_args) {
+        append_token(ctx, &ctx->args[ctx->next_arg++]);
+    }
+}
+
+// Ordered with the most frequent commands first
+static const command_t commands[] = {
+    COMMAND("MOT", handle_motor),
+    COMMAND("*STATUS?", handle_status),
+    COMMAND("*SNAPSHOT?", handle_snapshot),
+    COMMAND("*IDN?", handle_idn),
+    COMMAND("*TELEM", handle_set_telemetry),
+    COMMAND("*TELEM?", handle_get_telemetry),
+    COMMAND("*RESET", handle_reset),
+    COMMAND("*SYS", handle_sys),
+    COMMAND("CAP", handle_capture),
+    COMMAND("TRAJ", handle_traj),
+    COMMAND("TRAJ?", handle_get_traj),
+    COMMAND("*PWM", handle_set_pwm),
+    COMMAND("*PWM?", handle_get_pwm),
+    COMMAND("*ADC", handle_adc),
+    COMMAND("*ADC?", handle_get_adc),
+    COMMAND("*STATS?", handle_get_stats),
+    COMMAND("*STATS", handle_stats),
+    COMMAND("*SCHED?", handle_get_sched),
+    COMMAND("*ENERGY?", handle_get_energy),
+    COMMAND("*ENERGY", handle_energy),
+    COMMAND("*LOG?", handle_get_log),
+    COMMAND("*LOG", handle_log),
+    COMMAND("*CFG?", handle_get_config),
+    COMMAND("*CFG", handle_config),
+    COMMAND("ECHO", handle_echo),
+};
+
+static uint8_t parse_tag(const char* line, uint8_t* tag_len) {
+    // Finds an @<seq>: prefix, returns the length of the prefix or 0 if
+    // there isn't one. tag_len is the number of digits, 0 if malformed.
+    *tag_len = 0;
+    if (line[0] != '@') {
+        return 0;
+    }
+    uint8_t len = 1;
+    while (line[len] >= '0' && line[len] <= '9' && len <= MAX_TAG_DIGITS) {
+        len++;
+    }
+    if (len == 1 || line[len] != ':') {
+        return 1;
+    }
+    *tag_len = len - 1;
+    return len + 1;
+}
+
+static uint8_t append_tag(char* response, const char* line) {
+    // Responses to tagged commands start with the same @<seq>: prefix
+    uint8_t tag_len;
+    parse_tag(line, &tag_len);
+    if (tag_len == 0) {
+        return 0;
+    }
+    memcpy(response, line, tag_len + 1);
+    response[tag_len + 1] = ':';
+    return tag_len + 2;
+}
+
+static void send_response(const char* line, const char* msg) {
+    // Sends msg, tagged to match line
+    char response_buffer[USB_BUFFER_SIZE];
+    uint16_t resp_len = append_tag(response_buffer, line);
+    while (*msg != '\0' && resp_len < (USB_BUFFER_SIZE - 1)) {
+        response_buffer[resp_len++] = *msg++;
+    }
+    response_buffer[resp_len++] = '\n';
+    usart_send((uint8_t*)response_buffer, resp_len);
+}
+
+static void queue_line(void) {
+    // Moves the line in msg_buffer to the back of the command queue
+    msg_buffer[current_msg_len] = '\0'; // add null terminator to make it a string
+
+    line_status_t status = LINE_OK;
+    if (msg_too_long) {
+        status = LINE_TOO_LONG;
+    } else if (usart_rx_gaps() != msg_start_gaps) {
+        // This may also be a whole line lost before this one
+        status = LINE_DROPPED;
+    }
+    current_msg_len = 0;
+    msg_too_long = false;
+    msg_start_gaps = usart_rx_gaps();
+
+    // Data is only passed in while command_queue_full() is false, further
+    // lines wait in the receive buffer
+    queued_command_t* cmd = &command_queue[(queue_head + queue_count) % COMMAND_QUEUE_LEN];
+    memcpy(cmd->line, msg_buffer, MSG_MAXLEN);
+    cmd->status = status;
+    queue_count++;
+}
+
+void process_received_data(char new_data) {
+    if (new_data == '\n') {
+        queue_line();
+    } else if (new_data == '\r') {
+        // Drop carriage returns
+    } else {
+        if (current_msg_len == (MSG_MAXLEN - 1)) {
+            // keep the start of the line for its tag, NACK it at the newline
+            msg_too_long = true;
+            return;
+        }
+        msg_buffer[current_msg_len] = new_data;
+        current_msg_len++;
+    }
+}
+
+bool command_queue_full(void) {
+    return queue_count == COMMAND_QUEUE_LEN;
+}
+
+bool process_next_command(void) {
+    // Handles the oldest queued command, returns false if there were none
+    if (queue_count == 0) {
+        return false;
+    }
+    queued_command_t* cmd = &command_queue[queue_head];
+    uint8_t tag_len;
+    uint8_t prefix_len = parse_tag(cmd->line, &tag_len);
+
+    if (cmd->status == LINE_TOO_LONG) {
+        eventlog_record(EVENT_COMMAND_ERROR, EVENT_CMD_TOO_LONG, 0);
+        send_response(cmd->line, "NACK:Command too long");
+    } else if (cmd->status == LINE_DROPPED) {
+        eventlog_record(EVENT_COMMAND_ERROR, EVENT_CMD_OVERFLOW, 0);
+        send_response(cmd->line, "NACK:Receive overflow");
+    } else if (prefix_len != 0 && tag_len == 0) {
+        eventlog_record(EVENT_COMMAND_ERROR, EVENT_CMD_BAD_TAG, 0);
+        send_response(cmd->line, "NACK:Invalid sequence tag");
+    } else {
+        char response_buffer[USB_BUFFER_SIZE];
+        uint16_t resp_len = append_tag(response_buffer, cmd->line);
+
+        uint32_t start = stats_cycles();
+        uint16_t msg_len = handle_msg(&cmd->line[prefix_len], &response_buffer[resp_len], (USB_BUFFER_SIZE - 2) - resp_len);
+        stats_record(STATS_COMMAND, start);
+        if (msg_len >= 4 && memcmp(&response_buffer[resp_len], "NACK", 4) == 0) {
+            eventlog_record(EVENT_COMMAND_ERROR, EVENT_CMD_NACK, 0);
+        }
+        resp_len += msg_len;
+
+        response_buffer[resp_len++] = '\n';
+        usart_send((uint8_t*)response_buffer, resp_len);
+    }
+
+    queue_head = (queue_head + 1) % COMMAND_QUEUE_LEN;
+    queue_count--;
+    return true;
+}
+
+uint16_t handle_msg(const char* buf, char* response, int max_len) {
+    // max_len is the maximum length of the string that can be fitted in buf
+    // so the buffer must be at least max_len+1 long
+    // Returns the length of the response, which is also null terminated
+    cmd_ctx_t ctx = {
+        .response = response,
+        .resp_len = 0,
+        .resp_max = (uint16_t)max_len,
+    };
+
+    tokenize(buf, &ctx);
+
+    const token_t* verb = &ctx.args[ctx.next_arg++];
+    const command_t* cmd = find_command(verb, commands, NUM_COMMANDS(commands));
+    if (cmd != NULL) {
+        cmd->handler(&ctx);
+    } else {
+        append_str(&ctx, "NACK:Unknown command: '");
+        append_token(&ctx, verb);
+        append_str(&ctx, "'");
+    }
+
+    response[ctx.resp_len] = '\0';
+    return ctx.resp_len;
 }
 
-static char* itoa(int value, char* string) {
+char* itoa(int value, char* string) {
     // string must be a buffer of at least 12 chars
     // including stdio.h to get sprintf overflows the rom
     char tmp[11];
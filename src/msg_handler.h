@@ -1,20 +1,31 @@
 #pragma once
 
+#include <stdint.h>
+#include <stdbool.h>
+
 #include <libopencm3/stm32/pwr.h>
 #include <libopencm3/stm32/f1/bkp.h>
+#include <libopencm3/cm3/cortex.h>
 
 #define bootloader_flag (BKP_DR1 & 0xFFFF)
 #define BOOTLOADER_SIGNATURE 0xBEE5
 
 void process_received_data(char new_data);
-void handle_msg(char* buf, char* response, int max_len);
+bool command_queue_full(void);
+bool process_next_command(void);
+uint16_t handle_msg(const char* buf, char* response, int max_len);
 void enter_bootloader_next_cycle(void);
+char* itoa(int value, char* string);
+uint16_t str_append(char* buf, uint16_t len, uint16_t max_len, const char* src);
 
 static inline void set_bootloader_signature(uint32_t signature) {
-    pwr_disable_backup_domain_write_protect();
     // The backup registers are not cleared on reset
     // They are 16 bit registers and register 1 is used to signal when
-    // the bootloader should be entered
-    BKP_DR1 = signature;
-    pwr_enable_backup_domain_write_protect();
+    // the bootloader should be entered. The event log writes the others
+    // from interrupts, which re-enables the write protection.
+    CM_ATOMIC_BLOCK() {
+        pwr_disable_backup_domain_write_protect();
+        BKP_DR1 = signature;
+        pwr_enable_backup_domain_write_protect();
+    }
 }
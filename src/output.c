@@ -1,13 +1,30 @@
 #include "output.h"
 #include "led.h"
+#include "eventlog.h"
+#include "config.h"
 
 #include <stdlib.h>
 
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/timer.h>
 #include <libopencm3/stm32/gpio.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/cortex.h>
 
-#define MOTOR_SPEED_COEFF 2
+typedef struct {
+    uint16_t freq_hz;
+    uint16_t prescaler;
+    uint16_t period;  // counts per PWM period - 1
+} pwm_mode_t;
+
+// 24MHz / ((prescaler + 1) * (period + 1)), the first mode is the default
+static const pwm_mode_t pwm_modes[] = {
+    {.freq_hz = 6000, .prescaler = 1, .period = 2000},
+    {.freq_hz = 12000, .prescaler = 0, .period = 1999},
+    {.freq_hz = 20000, .prescaler = 0, .period = 1199},
+    {.freq_hz = 25000, .prescaler = 0, .period = 959},
+};
+#define NUM_PWM_MODES (sizeof(pwm_modes) / sizeof(pwm_modes[0]))
 
 static const struct {
     uint32_t INa;
@@ -34,6 +51,25 @@ static const struct {
 
 output_t output_data[NUM_OUTPUTS] = { 0 };
 
+// Values waiting for the next TIM2 update event
+static volatile int16_t staged_value[NUM_OUTPUTS];
+static volatile uint8_t staged_mask = 0;
+// Values whose compare has been written and will latch at the next update
+static int16_t latched_value[NUM_OUTPUTS];
+static uint8_t latched_mask = 0;
+// Values the compare registers were last written for
+static int16_t compare_value[NUM_OUTPUTS];
+// Highest duty the compare registers are written for, set by foldback
+static uint16_t duty_limit[NUM_OUTPUTS] = {MAX_MOTOR_VAL, MAX_MOTOR_VAL};
+// Outputs held disabled by a latched current limit trip until reset
+static volatile bool inhibited[NUM_OUTPUTS] = {false};
+
+// Selected mode, pwm_mode_staged is set until it has been written to TIM2
+static const pwm_mode_t* volatile pwm_mode = &pwm_modes[0];
+static volatile bool pwm_mode_staged = false;
+// Point in the PWM period that TRGO is raised, in 1/1000ths of the period
+static volatile uint16_t trigger_phase = 500;
+
 static void setup_gpio(void) {
     for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
         // setup ctrl gpio
@@ -49,6 +85,40 @@ static void setup_gpio(void) {
     }
 }
 
+static uint32_t trigger_compare(void) {
+    // A compare of 0 would never give a rising edge, and one past the
+    // period would never be reached
+    uint32_t compare = ((uint32_t)trigger_phase * (pwm_mode->period + 1)) / 1000;
+    if (compare < 1) {
+        return 1;
+    }
+    return (compare > pwm_mode->period)?(pwm_mode->period):(compare);
+}
+
+static uint32_t duty_to_compare(int16_t output_val) {
+    // Scales the motor power linearly onto the active PWM period,
+    // MAX_MOTOR_VAL is a compare past the end of the period so fully on
+    return ((uint32_t)abs(output_val) * (pwm_mode->period + 1)) / MAX_MOTOR_VAL;
+}
+
+static uint32_t output_compare(uint8_t output_num, int16_t output_val) {
+    // The compare for a value, reduced to the duty limit
+    uint16_t duty = (uint16_t)abs(output_val);
+    if (duty > duty_limit[output_num]) {
+        duty = duty_limit[output_num];
+    }
+    return duty_to_compare((int16_t)duty);
+}
+
+static const pwm_mode_t* find_pwm_mode(uint16_t freq_hz) {
+    for (uint8_t i = 0; i < NUM_PWM_MODES; i++) {
+        if (pwm_modes[i].freq_hz == freq_hz) {
+            return &pwm_modes[i];
+        }
+    }
+    return NULL;
+}
+
 void output_init(void) {
     for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
         output_data[i].enabled = false;
@@ -61,10 +131,14 @@ void output_init(void) {
     rcc_periph_clock_enable(RCC_TIM2);
     // Run the timer at 24MHz
     timer_set_mode(TIM2, TIM_CR1_CKD_CK_INT, TIM_CR1_CMS_EDGE, TIM_CR1_DIR_UP);
-    // Don't prescaler the timer clock, results in a ~12kHz PWM
-    timer_set_prescaler(TIM2, 1);
-    // Configure period to match available motor value range
-    timer_set_period(TIM2, (MOTOR_SPEED_COEFF * MAX_MOTOR_VAL));
+    // Start in the configured PWM mode, by default ~6kHz with 2001 counts per period
+    pwm_mode = find_pwm_mode((uint16_t)config_get(CONFIG_PWM_FREQUENCY));
+    if (pwm_mode == NULL) {
+        pwm_mode = &pwm_modes[0];
+    }
+    pwm_mode_staged = false;
+    timer_set_prescaler(TIM2, pwm_mode->prescaler);
+    timer_set_period(TIM2, pwm_mode->period);
 
     for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
         // Configure positive polarity output compare
@@ -76,11 +150,85 @@ void output_init(void) {
         timer_enable_oc_output(TIM2, output_pins[i].timer_chan);
     }
 
+    // OC3 isn't connected to a pin, its reference rises at the compare
+    // value in PWM2 mode and is output on TRGO to trigger the ADC
+    timer_set_oc_mode(TIM2, TIM_OC3, TIM_OCM_PWM2);
+    timer_enable_oc_preload(TIM2, TIM_OC3);
+    timer_set_oc_value(TIM2, TIM_OC3, trigger_compare());
+    timer_set_master_mode(TIM2, TIM_CR2_MMS_COMPARE_OC3REF);
+
     timer_enable_preload(TIM2);
+
+    // Setpoints are applied from the update interrupt, enabled on demand
+    nvic_set_priority(NVIC_TIM2_IRQ, 1);
+    nvic_enable_irq(NVIC_TIM2_IRQ);
+
     timer_enable_counter(TIM2);
 }
 
-void output_set_power(uint8_t output_num, int16_t output_val) {
+static void set_direction(uint8_t output_num, int16_t output_val) {
+    if (output_val > 0) {  // forward
+        gpio_set(GPIOB, output_pins[output_num].INa);
+        gpio_clear(GPIOB, output_pins[output_num].INb);
+    } else if (output_val < 0) {  // reverse
+        gpio_clear(GPIOB, output_pins[output_num].INa);
+        gpio_set(GPIOB, output_pins[output_num].INb);
+    } else {  // brake
+        gpio_clear(GPIOB, output_pins[output_num].INa);
+        gpio_clear(GPIOB, output_pins[output_num].INb);
+    }
+}
+
+void tim2_isr(void) {
+    if (!timer_get_flag(TIM2, TIM_SR_UIF)) {
+        return;
+    }
+    timer_clear_flag(TIM2, TIM_SR_UIF);
+
+    // The compare values written on the previous update have just been
+    // loaded, switch direction on the same edge
+    for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+        if (latched_mask & (1 << i)) {
+            set_direction(i, latched_value[i]);
+        }
+    }
+    latched_mask = 0;
+
+    // The prescaler, period and compare registers are all preloaded so a new
+    // PWM mode and the rescaled compares take effect on the same update
+    if (pwm_mode_staged) {
+        pwm_mode_staged = false;
+        timer_set_prescaler(TIM2, pwm_mode->prescaler);
+        timer_set_period(TIM2, pwm_mode->period);
+        for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+            if (compare_value[i] != 0) {
+                timer_set_oc_value(TIM2, output_pins[i].timer_chan, output_compare(i, compare_value[i]));
+            }
+        }
+        timer_set_oc_value(TIM2, TIM_OC3, trigger_compare());
+    }
+
+    // Write newly staged speeds, the preloaded compare registers only take
+    // effect at the start of the next PWM period
+    for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+        if (staged_mask & (1 << i)) {
+            int16_t output_val = staged_value[i];
+            if (output_val != 0) {
+                timer_set_oc_value(TIM2, output_pins[i].timer_chan, output_compare(i, output_val));
+                compare_value[i] = output_val;
+            }
+            latched_value[i] = output_val;
+            latched_mask |= (1 << i);
+        }
+    }
+    staged_mask = 0;
+
+    if (latched_mask == 0) {
+        timer_disable_irq(TIM2, TIM_DIER_UIE);
+    }
+}
+
+void output_stage_power(uint8_t output_num, int16_t output_val) {
     if (!(output_num < NUM_OUTPUTS)) {
         // skip invalid output numbers
         return;
@@ -89,37 +237,127 @@ void output_set_power(uint8_t output_num, int16_t output_val) {
         // skip invalid output values
         return;
     }
+    if (inhibited[output_num]) {
+        // stays off until outputs_reset()
+        return;
+    }
 
     if (!output_data[output_num].enabled) {
-        // enable output if it wasn't previously
+        // enable output if it wasn't previously, it brakes until committed
         gpio_set(GPIOB, output_pins[output_num].ENa);
         gpio_set(GPIOB, output_pins[output_num].ENb);
 
         output_data[output_num].enabled = true;
     }
 
-    // set direction
-    if (output_val > 0) {  // forward
-        gpio_set(GPIOB, output_pins[output_num].INa);
-        gpio_clear(GPIOB, output_pins[output_num].INb);
-
-        // set speed
-        timer_set_oc_value(TIM2, output_pins[output_num].timer_chan, output_val * MOTOR_SPEED_COEFF);
-    } else if (output_val < 0) {  // reverse
-        gpio_clear(GPIOB, output_pins[output_num].INa);
-        gpio_set(GPIOB, output_pins[output_num].INb);
-
-        // set speed
-        timer_set_oc_value(TIM2, output_pins[output_num].timer_chan, -output_val * MOTOR_SPEED_COEFF);
-    } else if (output_val == 0) {  // brake
-        gpio_clear(GPIOB, output_pins[output_num].INa);
-        gpio_clear(GPIOB, output_pins[output_num].INb);
+    CM_ATOMIC_BLOCK() {
+        staged_value[output_num] = output_val;
+        staged_mask |= (1 << output_num);
     }
 
     // store set speed
     output_data[output_num].value = output_val;
 }
 
+void output_commit(void) {
+    // Apply all staged values from the TIM2 update interrupt
+    CM_ATOMIC_BLOCK() {
+        if (!(TIM_DIER(TIM2) & TIM_DIER_UIE)) {
+            // Discard a stale flag so the first interrupt is on a fresh update
+            timer_clear_flag(TIM2, TIM_SR_UIF);
+            timer_enable_irq(TIM2, TIM_DIER_UIE);
+        }
+    }
+}
+
+bool output_pwm_frequency_supported(uint16_t freq_hz) {
+    return find_pwm_mode(freq_hz) != NULL;
+}
+
+bool output_set_pwm_frequency(uint16_t freq_hz) {
+    // Returns false if there is no mode for the frequency
+    const pwm_mode_t* mode = find_pwm_mode(freq_hz);
+    if (mode == NULL) {
+        return false;
+    }
+    // The interrupt writes the new mode before any compares scaled for it
+    CM_ATOMIC_BLOCK() {
+        pwm_mode = mode;
+        pwm_mode_staged = true;
+    }
+    output_commit();
+    return true;
+}
+
+uint16_t output_get_pwm_frequency(void) {
+    return pwm_mode->freq_hz;
+}
+
+uint16_t output_get_pwm_resolution(void) {
+    // counts per PWM period
+    return pwm_mode->period + 1;
+}
+
+uint32_t output_get_pwm_rate(void) {
+    // Exact rate of PWM periods, the mode frequencies are rounded
+    return 24000000 / ((pwm_mode->prescaler + 1) * (pwm_mode->period + 1));
+}
+
+void output_set_trigger_phase(uint16_t phase) {
+    if (phase > 999) {
+        // skip invalid phases
+        return;
+    }
+    CM_ATOMIC_BLOCK() {
+        trigger_phase = phase;
+        // preloaded, so takes effect from the next PWM period
+        timer_set_oc_value(TIM2, TIM_OC3, trigger_compare());
+    }
+}
+
+uint16_t output_get_trigger_phase(void) {
+    return trigger_phase;
+}
+
+void output_set_duty_limit(uint8_t output_num, uint16_t limit) {
+    if (!(output_num < NUM_OUTPUTS)) {
+        // skip invalid output numbers
+        return;
+    }
+    if (limit > MAX_MOTOR_VAL) {
+        limit = MAX_MOTOR_VAL;
+    }
+    CM_ATOMIC_BLOCK() {
+        duty_limit[output_num] = limit;
+        // preloaded, so takes effect from the next PWM period
+        if (compare_value[output_num] != 0) {
+            timer_set_oc_value(TIM2, output_pins[output_num].timer_chan, output_compare(output_num, compare_value[output_num]));
+        }
+    }
+}
+
+void output_inhibit(uint8_t output_num) {
+    if (!(output_num < NUM_OUTPUTS)) {
+        // skip invalid output numbers
+        return;
+    }
+    inhibited[output_num] = true;
+    output_disable(output_num);
+}
+
+bool output_inhibited(uint8_t output_num) {
+    if (!(output_num < NUM_OUTPUTS)) {
+        // skip invalid output numbers
+        return false;
+    }
+    return inhibited[output_num];
+}
+
+void output_set_power(uint8_t output_num, int16_t output_val) {
+    output_stage_power(output_num, output_val);
+    output_commit();
+}
+
 bool output_enabled(uint8_t output_num) {
     if (!(output_num < NUM_OUTPUTS)) {
         // skip invalid output numbers
@@ -150,6 +388,16 @@ void output_disable(uint8_t output_num) {
 
     output_data[output_num].enabled = false;
 
+    // drop any value still waiting to be applied and brake, so enabling
+    // again doesn't drive the old direction until the new one is latched
+    CM_ATOMIC_BLOCK() {
+        staged_mask &= ~(1 << output_num);
+        latched_mask &= ~(1 << output_num);
+        set_direction(output_num, 0);
+        timer_set_oc_value(TIM2, output_pins[output_num].timer_chan, 0);
+        compare_value[output_num] = 0;
+    }
+
     gpio_clear(GPIOB, output_pins[output_num].ENa);
     gpio_clear(GPIOB, output_pins[output_num].ENb);
 }
@@ -165,28 +413,42 @@ uint16_t output_get_current(uint8_t output_num) {
 
 void check_output_faults(void) {
     for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
-        if (output_data[i].enabled) {
-            // The h-bridge drives the enable pin low when a fault occurs
-            if (
-                (!gpio_get(GPIOB, output_pins[i].ENa))
-                || (!gpio_get(GPIOB, output_pins[i].ENb))
-            ) {
-                // A fault has occured on the output
-                output_data[i].in_fault = true;
-                led_set((i == 0)?(LED_M0_R):(LED_M1_R));
+        // A current limit can disable the output from the ADC interrupt
+        // between reading enabled and the pins
+        CM_ATOMIC_BLOCK() {
+            if (output_data[i].enabled) {
+                // The h-bridge drives the enable pin low when a fault occurs
+                if (
+                    (!gpio_get(GPIOB, output_pins[i].ENa))
+                    || (!gpio_get(GPIOB, output_pins[i].ENb))
+                ) {
+                    // A fault has occured on the output
+                    if (!output_data[i].in_fault) {
+                        eventlog_record(EVENT_FAULT, i, output_data[i].current);
+                    }
+                    output_data[i].in_fault = true;
+                    led_set((i == 0)?(LED_M0_R):(LED_M1_R));
+                } else {
+                    if (output_data[i].in_fault) {
+                        eventlog_record(EVENT_FAULT_CLEAR, i, output_data[i].current);
+                    }
+                    output_data[i].in_fault = false;
+                    led_clear((i == 0)?(LED_M0_R):(LED_M1_R));
+                }
             } else {
+                if (output_data[i].in_fault) {
+                    eventlog_record(EVENT_FAULT_CLEAR, i, output_data[i].current);
+                }
                 output_data[i].in_fault = false;
                 led_clear((i == 0)?(LED_M0_R):(LED_M1_R));
             }
-        } else {
-            output_data[i].in_fault = false;
-            led_clear((i == 0)?(LED_M0_R):(LED_M1_R));
         }
     }
 }
 
 void outputs_reset(void) {
     for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+        inhibited[i] = false;
         output_disable(i);
         output_data[i].in_fault = false;
         output_data[i].current = 0;
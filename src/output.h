@@ -19,6 +19,21 @@ extern output_t output_data[];
 void output_init(void);
 
 void output_set_power(uint8_t output_num, int16_t output_val);
+void output_stage_power(uint8_t output_num, int16_t output_val);
+void output_commit(void);
+bool output_pwm_frequency_supported(uint16_t freq_hz);
+bool output_set_pwm_frequency(uint16_t freq_hz);
+uint16_t output_get_pwm_frequency(void);
+uint16_t output_get_pwm_resolution(void);
+uint32_t output_get_pwm_rate(void);
+// TIM2 TRGO rises at this point in each PWM period, in 1/1000ths of the period
+void output_set_trigger_phase(uint16_t phase);
+uint16_t output_get_trigger_phase(void);
+// Caps the duty of the PWM without changing the set value
+void output_set_duty_limit(uint8_t output_num, uint16_t limit);
+// Disables the output and ignores new values until outputs_reset()
+void output_inhibit(uint8_t output_num);
+bool output_inhibited(uint8_t output_num);
 bool output_enabled(uint8_t output_num);
 int16_t output_get_output(uint8_t output_num);
 void output_disable(uint8_t output_num);
@@ -0,0 +1,144 @@
+#include "ramp.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <libopencm3/cm3/cortex.h>
+
+#include "output.h"
+
+// ramp_tick is called at 1kHz so a rate in power per second is the step in
+// thousandths of motor power per tick
+#define RAMP_SCALE 1000
+
+typedef struct {
+    uint16_t accel;  // moving away from zero
+    uint16_t decel;  // moving towards zero
+    bool active;
+    int32_t position;  // thousandths of motor power
+    int32_t target;  // thousandths of motor power
+} ramp_t;
+
+static ramp_t ramps[NUM_OUTPUTS] = { 0 };
+
+void ramp_set_limits(uint8_t output_num, uint16_t accel, uint16_t decel) {
+    if (!(output_num < NUM_OUTPUTS)) {
+        // skip invalid output numbers
+        return;
+    }
+    CM_ATOMIC_BLOCK() {
+        ramps[output_num].accel = accel;
+        ramps[output_num].decel = decel;
+    }
+}
+
+uint16_t ramp_get_accel(uint8_t output_num) {
+    if (!(output_num < NUM_OUTPUTS)) {
+        // skip invalid output numbers
+        return 0;
+    }
+    return ramps[output_num].accel;
+}
+
+uint16_t ramp_get_decel(uint8_t output_num) {
+    if (!(output_num < NUM_OUTPUTS)) {
+        // skip invalid output numbers
+        return 0;
+    }
+    return ramps[output_num].decel;
+}
+
+void ramp_stage_target(uint8_t output_num, int16_t target) {
+    // Stage a setpoint, applied by output_commit() when no ramp is configured
+    if (!(output_num < NUM_OUTPUTS)) {
+        // skip invalid output numbers
+        return;
+    }
+    if (target < MIN_MOTOR_VAL || target > MAX_MOTOR_VAL) {
+        // skip invalid output values
+        return;
+    }
+
+    ramp_t* ramp = &ramps[output_num];
+    CM_ATOMIC_BLOCK() {
+        if (ramp->accel == 0 && ramp->decel == 0) {
+            ramp->active = false;
+            output_stage_power(output_num, target);
+        } else {
+            if (!ramp->active) {
+                // start from the current output, a disabled output is at rest
+                ramp->position = (int32_t)output_get_output(output_num) * RAMP_SCALE;
+            }
+            ramp->target = (int32_t)target * RAMP_SCALE;
+            ramp->active = true;
+        }
+    }
+}
+
+void ramp_set_target(uint8_t output_num, int16_t target) {
+    ramp_stage_target(output_num, target);
+    output_commit();
+}
+
+void ramp_stop(uint8_t output_num) {
+    if (!(output_num < NUM_OUTPUTS)) {
+        // skip invalid output numbers
+        return;
+    }
+    ramps[output_num].active = false;
+}
+
+void ramp_reset(void) {
+    for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+        ramps[i].active = false;
+    }
+}
+
+static int32_t ramp_step(const ramp_t* ramp) {
+    int32_t position = ramp->position;
+    int32_t limit = ramp->target;
+    bool towards_zero = (position > 0 && limit < position) || (position < 0 && limit > position);
+    int32_t rate = towards_zero?(ramp->decel):(ramp->accel);
+
+    if ((position > 0 && limit < 0) || (position < 0 && limit > 0)) {
+        // Changing direction, decelerate to a stop before accelerating again
+        limit = 0;
+    }
+
+    if (rate == 0) {
+        return limit;
+    }
+    if (limit > position) {
+        return (limit - position > rate)?(position + rate):(limit);
+    } else {
+        return (position - limit > rate)?(position - rate):(limit);
+    }
+}
+
+void ramp_tick(void) {
+    // Called at 1kHz from the SysTick interrupt
+    bool staged = false;
+
+    for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+        ramp_t* ramp = &ramps[i];
+        // A current limit can stop the ramp from the ADC interrupt
+        CM_ATOMIC_BLOCK() {
+            if (ramp->active) {
+                ramp->position = ramp_step(ramp);
+                if (ramp->position == ramp->target) {
+                    ramp->active = false;
+                }
+
+                int16_t output_val = (int16_t)(ramp->position / RAMP_SCALE);
+                if (output_val != output_get_output(i) || !output_enabled(i)) {
+                    output_stage_power(i, output_val);
+                    staged = true;
+                }
+            }
+        }
+    }
+
+    if (staged) {
+        output_commit();
+    }
+}
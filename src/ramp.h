@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Rates are in motor power per second, 0 disables the limit
+void ramp_set_limits(uint8_t output_num, uint16_t accel, uint16_t decel);
+uint16_t ramp_get_accel(uint8_t output_num);
+uint16_t ramp_get_decel(uint8_t output_num);
+
+void ramp_stage_target(uint8_t output_num, int16_t target);
+void ramp_set_target(uint8_t output_num, int16_t target);
+void ramp_stop(uint8_t output_num);
+void ramp_reset(void);
+
+// Run at 1kHz from the SysTick interrupt
+void ramp_tick(void);
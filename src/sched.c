@@ -0,0 +1,105 @@
+#include "sched.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <libopencm3/cm3/cortex.h>
+
+#include "stats.h"
+
+typedef struct {
+    void (*run)(void);
+    uint16_t period_ms;
+    uint16_t countdown;  // ticks until the task is next due
+    bool due;
+    uint32_t runs;
+    uint32_t overruns;
+    uint32_t max_cycles;
+} sched_task_t;
+
+static volatile sched_task_t tasks[SCHED_NUM_TASKS];
+static bool running = false;  // sched_run() can be reached from a task
+
+void sched_add(sched_task_id_t id, uint16_t period_ms, void (*run)(void)) {
+    if (!(id < SCHED_NUM_TASKS)) {
+        // skip invalid tasks
+        return;
+    }
+    CM_ATOMIC_BLOCK() {
+        tasks[id].run = run;
+        tasks[id].period_ms = (run != NULL)?(period_ms):(0);
+        tasks[id].countdown = period_ms;
+        tasks[id].due = false;
+    }
+}
+
+void sched_tick(void) {
+    for (uint8_t i = 0; i < SCHED_NUM_TASKS; i++) {
+        volatile sched_task_t* task = &tasks[i];
+        if (task->period_ms == 0) {
+            continue;
+        }
+        if (--task->countdown != 0) {
+            continue;
+        }
+        task->countdown = task->period_ms;
+        if (task->due) {
+            // still waiting from the last period, so this one is lost
+            task->overruns++;
+        }
+        task->due = true;
+    }
+}
+
+void sched_run(void) {
+    if (running) {
+        return;
+    }
+    running = true;
+    uint8_t i = 0;
+    while (i < SCHED_NUM_TASKS) {
+        volatile sched_task_t* task = &tasks[i];
+        if (!task->due) {
+            i++;
+            continue;
+        }
+        // A single store, the tick only sets it
+        task->due = false;
+
+        uint32_t start = stats_cycles();
+        task->run();
+        uint32_t elapsed = stats_cycles() - start;
+        task->runs++;
+        if (elapsed > task->max_cycles) {
+            task->max_cycles = elapsed;
+        }
+
+        // Higher priority tasks that became due meanwhile go first
+        i = 0;
+    }
+    running = false;
+}
+
+void sched_get_stats(sched_task_id_t id, sched_task_stats_t* stats) {
+    if (!(id < SCHED_NUM_TASKS)) {
+        // skip invalid tasks
+        return;
+    }
+    CM_ATOMIC_BLOCK() {
+        stats->period_ms = tasks[id].period_ms;
+        stats->runs = tasks[id].runs;
+        stats->overruns = tasks[id].overruns;
+        stats->max_cycles = tasks[id].max_cycles;
+    }
+}
+
+void sched_reset_stats(void) {
+    CM_ATOMIC_BLOCK() {
+        for (uint8_t i = 0; i < SCHED_NUM_TASKS; i++) {
+            tasks[i].runs = 0;
+            tasks[i].overruns = 0;
+            tasks[i].max_cycles = 0;
+        }
+    }
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Periodic housekeeping tasks, in priority order. They are counted down by
+// the SysTick interrupt and run from the main loop, highest priority first.
+typedef enum {
+    SCHED_FAULTS,  // check_output_faults
+    SCHED_TELEMETRY,  // telemetry_poll
+    SCHED_MONITOR,  // analogue_monitor
+    SCHED_NUM_TASKS,
+} sched_task_id_t;
+
+typedef struct {
+    uint16_t period_ms;
+    uint32_t runs;
+    uint32_t overruns;  // periods that elapsed before the task had run
+    uint32_t max_cycles;
+} sched_task_stats_t;
+
+// Tasks aren't run until added, a period of 0 stops the task
+void sched_add(sched_task_id_t id, uint16_t period_ms, void (*run)(void));
+// Called at 1kHz from the SysTick interrupt
+void sched_tick(void);
+// Runs the due tasks from the main loop, and while waiting to send a long
+// response. Returns straight away if called from a task.
+void sched_run(void);
+
+void sched_get_stats(sched_task_id_t id, sched_task_stats_t* stats);
+void sched_reset_stats(void);
@@ -0,0 +1,99 @@
+#include "stats.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <libopencm3/cm3/dwt.h>
+#include <libopencm3/cm3/cortex.h>
+
+#include "usart.h"
+
+static stats_timing_t timings[STATS_NUM_TIMINGS];
+static volatile uint32_t adc_overruns = 0;
+
+// Cycles spent in timed interrupts, wraps
+static volatile uint32_t interrupt_cycles = 0;
+
+// Main loop passes, only accessed from the main loop
+static uint32_t pass_start = 0;
+static uint32_t pass_interrupt_cycles = 0;
+static uint64_t total_cycles = 0;
+static uint64_t idle_cycles = 0;
+
+void stats_init(void) {
+    // Also enables the trace unit the counter is part of
+    dwt_enable_cycle_counter();
+    stats_reset();
+}
+
+void stats_reset(void) {
+    CM_ATOMIC_BLOCK() {
+        for (uint8_t i = 0; i < STATS_NUM_TIMINGS; i++) {
+            timings[i] = (stats_timing_t){.min = UINT32_MAX, .max = 0, .count = 0, .total = 0};
+        }
+        adc_overruns = 0;
+        usart_errors = (usart_errors_t){ 0 };
+    }
+    total_cycles = 0;
+    idle_cycles = 0;
+}
+
+void stats_record(stats_timing_id_t id, uint32_t start) {
+    // Each timing is only recorded from one context
+    uint32_t elapsed = stats_cycles() - start;
+    stats_timing_t* timing = &timings[id];
+
+    if (elapsed < timing->min) {
+        timing->min = elapsed;
+    }
+    if (elapsed > timing->max) {
+        timing->max = elapsed;
+    }
+    timing->count++;
+    timing->total += elapsed;
+
+    if (id == STATS_ADC_ISR) {
+        interrupt_cycles += elapsed;
+    }
+}
+
+void stats_get_timing(stats_timing_id_t id, stats_timing_t* timing) {
+    CM_ATOMIC_BLOCK() {
+        *timing = timings[id];
+    }
+    if (timing->count == 0) {
+        timing->min = 0;
+    }
+}
+
+void stats_adc_overrun(void) {
+    adc_overruns++;
+}
+
+uint32_t stats_get_adc_overruns(void) {
+    return adc_overruns;
+}
+
+void stats_pass_begin(void) {
+    pass_start = stats_cycles();
+    pass_interrupt_cycles = interrupt_cycles;
+}
+
+void stats_pass_end(bool idle) {
+    uint32_t elapsed = stats_cycles() - pass_start;
+    total_cycles += elapsed;
+    if (idle) {
+        // Interrupts that woke the core were still work
+        uint32_t busy = interrupt_cycles - pass_interrupt_cycles;
+        if (busy < elapsed) {
+            idle_cycles += elapsed - busy;
+        }
+    }
+}
+
+uint8_t stats_get_idle_percent(void) {
+    if (total_cycles == 0) {
+        return 100;
+    }
+    return (uint8_t)((idle_cycles * 100) / total_cycles);
+}
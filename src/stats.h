@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <libopencm3/cm3/dwt.h>
+
+typedef enum {
+    STATS_ADC_ISR,  // adc1_2_isr
+    STATS_COMMAND,  // handling a text command, excluding sending the response
+    STATS_USART_TX,  // queueing data to send, including waiting for a free slot
+    STATS_NUM_TIMINGS,
+} stats_timing_id_t;
+
+typedef struct {
+    uint32_t min;  // cycles
+    uint32_t max;
+    uint32_t count;
+    uint64_t total;
+} stats_timing_t;
+
+void stats_init(void);
+void stats_reset(void);
+
+static inline uint32_t stats_cycles(void) {
+    return dwt_read_cycle_counter();
+}
+// start is the value of stats_cycles() at the start of the timed section
+void stats_record(stats_timing_id_t id, uint32_t start);
+void stats_get_timing(stats_timing_id_t id, stats_timing_t* timing);
+
+// Called from adc1_2_isr when another scan finished before it returned
+void stats_adc_overrun(void);
+uint32_t stats_get_adc_overruns(void);
+
+// Called around the parts of the main loop, idle while it is asleep
+void stats_pass_begin(void);
+void stats_pass_end(bool idle);
+uint8_t stats_get_idle_percent(void);
@@ -0,0 +1,108 @@
+#include "telemetry.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <libopencm3/cm3/cortex.h>
+
+#include "output.h"
+#include "analogue.h"
+#include "usart.h"
+#include "clock.h"
+#include "msg_handler.h"
+#include "bin_handler.h"
+
+uint32_t telemetry_dropped = 0;
+
+static uint16_t telemetry_rate = 0;
+static uint32_t telemetry_period_ms = 0;
+static uint32_t next_report_time = 0;
+
+void telemetry_snapshot(telemetry_snapshot_t* snapshot) {
+    // The ADC interrupt and ramp tick update these, copy them in one go
+    CM_ATOMIC_BLOCK() {
+        snapshot->sample = analogue_sample_count();
+        memcpy(snapshot->outputs, output_data, sizeof(snapshot->outputs));
+        snapshot->input_voltage = input_voltage;
+    }
+    for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+        // as output_get_output() reports it
+        if (!snapshot->outputs[i].enabled) {
+            snapshot->outputs[i].value = 0;
+        }
+    }
+}
+
+static void send_text_report(void) {
+    // !TELEM:<value 0>,<value 1>:<current 0>,<current 1>:<faults 0>,<faults 1>:<input voltage>
+    char line[USART_TX_SLOT_SIZE];
+    char temp_str[12];
+    const uint16_t max_len = sizeof(line) - 1;  // leaves room for the newline
+    telemetry_snapshot_t snapshot;
+    telemetry_snapshot(&snapshot);
+
+    uint16_t len = str_append(line, 0, max_len, "!TELEM:");
+    for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+        if (i != 0) {len = str_append(line, len, max_len, ",");}
+        len = str_append(line, len, max_len, itoa(snapshot.outputs[i].value, temp_str));
+    }
+    len = str_append(line, len, max_len, ":");
+    for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+        if (i != 0) {len = str_append(line, len, max_len, ",");}
+        len = str_append(line, len, max_len, itoa(snapshot.outputs[i].current, temp_str));
+    }
+    len = str_append(line, len, max_len, ":");
+    for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+        if (i != 0) {len = str_append(line, len, max_len, ",");}
+        len = str_append(line, len, max_len, (snapshot.outputs[i].in_fault)?"1":"0");
+    }
+    len = str_append(line, len, max_len, ":");
+    len = str_append(line, len, max_len, itoa(snapshot.input_voltage, temp_str));
+    line[len++] = '\n';
+
+    usart_send((const uint8_t*)line, len);
+}
+
+void telemetry_set_rate(uint16_t rate_hz) {
+    if (rate_hz > TELEMETRY_MAX_RATE) {
+        rate_hz = TELEMETRY_MAX_RATE;
+    }
+    telemetry_rate = rate_hz;
+    // Rounded up, so reports are never sent faster than asked
+    telemetry_period_ms = (rate_hz != 0)?((1000 + rate_hz - 1) / rate_hz):(0);
+    next_report_time = clock_millis() + telemetry_period_ms;
+}
+
+uint16_t telemetry_get_rate(void) {
+    return telemetry_rate;
+}
+
+void telemetry_poll(void) {
+    if (telemetry_rate == 0) {
+        return;
+    }
+
+    uint32_t now = clock_millis();
+    if ((int32_t)(now - next_report_time) < 0) {
+        return;
+    }
+    next_report_time += telemetry_period_ms;
+    if ((int32_t)(now - next_report_time) >= 0) {
+        // fell more than a period behind, don't try to catch up
+        next_report_time = now + telemetry_period_ms;
+    }
+
+    // Never wait for the USART, command responses take priority. A baud
+    // rate change waits for the output to go idle, which reports would
+    // otherwise hold off indefinitely.
+    if (!usart_tx_ready() || usart_baud_change_pending()) {
+        telemetry_dropped++;
+        return;
+    }
+
+    if (bin_mode_active()) {
+        bin_send_telemetry();
+    } else {
+        send_text_report();
+    }
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "output.h"
+
+#define TELEMETRY_MAX_RATE 1000  // Hz, limited by the millisecond clock
+
+// Number of reports skipped because the USART was still busy
+extern uint32_t telemetry_dropped;
+
+typedef struct {
+    uint32_t sample;  // analogue_sample_count() of the latest scan
+    output_t outputs[NUM_OUTPUTS];
+    uint16_t input_voltage;
+} telemetry_snapshot_t;
+
+// All values from between the same two ADC scans
+void telemetry_snapshot(telemetry_snapshot_t* snapshot);
+
+void telemetry_set_rate(uint16_t rate_hz);
+uint16_t telemetry_get_rate(void);
+void telemetry_poll(void);
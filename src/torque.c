@@ -0,0 +1,156 @@
+#include "torque.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "output.h"
+
+typedef struct {
+    volatile bool active;
+    volatile int16_t target;  // mA, the sign selects the direction
+    uint16_t kp;
+    uint16_t ki;
+    int32_t integral;  // motor power, shifted by TORQUE_GAIN_SHIFT
+    uint32_t current_sum;  // mA, summed over the decimation period
+} torque_loop_t;
+
+static torque_loop_t loops[NUM_OUTPUTS] = {
+    {.kp = TORQUE_DEFAULT_KP, .ki = TORQUE_DEFAULT_KI},
+    {.kp = TORQUE_DEFAULT_KP, .ki = TORQUE_DEFAULT_KI},
+};
+static uint8_t decimation_count = 0;
+
+void torque_set_target(uint8_t output_num, int16_t target_ma) {
+    if (!(output_num < NUM_OUTPUTS)) {
+        // skip invalid output numbers
+        return;
+    }
+    if (target_ma < -TORQUE_MAX_CURRENT || target_ma > TORQUE_MAX_CURRENT) {
+        // skip invalid currents
+        return;
+    }
+
+    torque_loop_t* loop = &loops[output_num];
+    // Stop the ISR using the loop while it is updated
+    bool keep_integral = loop->active && ((loop->target < 0) == (target_ma < 0));
+    loop->active = false;
+    if (!keep_integral) {
+        loop->integral = 0;
+    }
+    loop->target = target_ma;
+    loop->active = true;
+}
+
+void torque_release(uint8_t output_num) {
+    if (!(output_num < NUM_OUTPUTS)) {
+        // skip invalid output numbers
+        return;
+    }
+    loops[output_num].active = false;
+}
+
+bool torque_active(uint8_t output_num) {
+    if (!(output_num < NUM_OUTPUTS)) {
+        // skip invalid output numbers
+        return false;
+    }
+    return loops[output_num].active;
+}
+
+int16_t torque_get_target(uint8_t output_num) {
+    if (!(output_num < NUM_OUTPUTS)) {
+        // skip invalid output numbers
+        return 0;
+    }
+    return loops[output_num].target;
+}
+
+void torque_set_gains(uint8_t output_num, uint16_t kp, uint16_t ki) {
+    if (!(output_num < NUM_OUTPUTS)) {
+        // skip invalid output numbers
+        return;
+    }
+    // The ISR may briefly pair a new gain with an old one, which is harmless
+    loops[output_num].kp = kp;
+    loops[output_num].ki = ki;
+}
+
+uint16_t torque_get_kp(uint8_t output_num) {
+    if (!(output_num < NUM_OUTPUTS)) {
+        // skip invalid output numbers
+        return 0;
+    }
+    return loops[output_num].kp;
+}
+
+uint16_t torque_get_ki(uint8_t output_num) {
+    if (!(output_num < NUM_OUTPUTS)) {
+        // skip invalid output numbers
+        return 0;
+    }
+    return loops[output_num].ki;
+}
+
+void torque_reset(void) {
+    for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+        loops[i].active = false;
+        loops[i].target = 0;
+    }
+}
+
+static int16_t run_loop(torque_loop_t* loop, uint16_t measured) {
+    // PI control of the current magnitude, the direction comes from the target
+    int32_t target = (loop->target < 0)?(-loop->target):(loop->target);
+    if (target == 0) {
+        loop->integral = 0;
+        return 0;
+    }
+
+    int32_t error = target - (int32_t)measured;
+    int32_t max_integral = (int32_t)MAX_MOTOR_VAL << TORQUE_GAIN_SHIFT;
+
+    // Anti-windup: the integral alone can never exceed the output range
+    loop->integral += (int32_t)loop->ki * error;
+    if (loop->integral > max_integral) {
+        loop->integral = max_integral;
+    } else if (loop->integral < 0) {
+        loop->integral = 0;
+    }
+
+    int32_t output = ((int32_t)loop->kp * error + loop->integral) >> TORQUE_GAIN_SHIFT;
+    if (output > MAX_MOTOR_VAL) {
+        output = MAX_MOTOR_VAL;
+    } else if (output < 0) {
+        output = 0;
+    }
+
+    return (int16_t)((loop->target < 0)?(-output):(output));
+}
+
+void torque_update(uint16_t m0_current, uint16_t m1_current) {
+    // Called from the ADC ISR with the unfiltered currents of each scan
+    loops[0].current_sum += m0_current;
+    loops[1].current_sum += m1_current;
+
+    if (++decimation_count < TORQUE_DECIMATION) {
+        return;
+    }
+    decimation_count = 0;
+
+    bool staged = false;
+    for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+        torque_loop_t* loop = &loops[i];
+        uint16_t measured = (uint16_t)(loop->current_sum / TORQUE_DECIMATION);
+        loop->current_sum = 0;
+
+        if (!loop->active) {
+            continue;
+        }
+        output_stage_power(i, run_loop(loop, measured));
+        staged = true;
+    }
+
+    if (staged) {
+        output_commit();
+    }
+}
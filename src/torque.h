@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TORQUE_MAX_CURRENT 20000  // mA, the full range of the current sense
+// Run the current loop once every this many ADC scans
+#define TORQUE_DECIMATION 4
+// Gains are fixed point with this many fractional bits, in motor power per mA
+#define TORQUE_GAIN_SHIFT 8
+#define TORQUE_DEFAULT_KP 13  // ~0.05 power/mA
+#define TORQUE_DEFAULT_KI 2
+
+void torque_set_target(uint8_t output_num, int16_t target_ma);
+void torque_release(uint8_t output_num);
+bool torque_active(uint8_t output_num);
+int16_t torque_get_target(uint8_t output_num);
+void torque_set_gains(uint8_t output_num, uint16_t kp, uint16_t ki);
+uint16_t torque_get_kp(uint8_t output_num);
+uint16_t torque_get_ki(uint8_t output_num);
+void torque_reset(void);
+
+void torque_update(uint16_t m0_current, uint16_t m1_current);
@@ -0,0 +1,201 @@
+#include "traj.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/timer.h>
+#include <libopencm3/stm32/dbgmcu.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/cortex.h>
+
+#include "output.h"
+#include "torque.h"
+#include "ramp.h"
+
+#define TRAJ_MASK (TRAJ_DEPTH - 1)
+
+static traj_entry_t entries[TRAJ_DEPTH];
+// Free running, head is advanced by the interrupt and tail by traj_add()
+static volatile uint8_t head = 0;
+static volatile uint8_t tail = 0;
+static uint32_t last_time_us = 0;  // of the last entry added
+
+static volatile traj_state_t state = TRAJ_IDLE;
+static volatile uint32_t played = 0;
+static volatile uint32_t max_late_us = 0;
+static uint32_t start_us = 0;
+static volatile uint32_t end_us = 0;
+
+// TIM3 counts us, the overflows extend it to 32 bits
+static volatile uint32_t epoch = 0;
+
+void traj_init(void) {
+    rcc_periph_clock_enable(RCC_TIM3);
+
+    timer_set_mode(TIM3, TIM_CR1_CKD_CK_INT, TIM_CR1_CMS_EDGE, TIM_CR1_DIR_UP);
+    // 24MHz/24 = 1MHz, free running over the full 16 bits
+    timer_set_prescaler(TIM3, 23);
+    timer_set_period(TIM3, 0xFFFF);
+    // The compare only interrupts, entries are due when it matches
+    timer_set_oc_mode(TIM3, TIM_OC1, TIM_OCM_FROZEN);
+    timer_disable_oc_preload(TIM3, TIM_OC1);
+    // Load the prescaler now rather than at the first overflow
+    timer_generate_event(TIM3, TIM_EGR_UG);
+    timer_clear_flag(TIM3, TIM_SR_UIF);
+
+    // Same priority as the PWM update, so an entry is staged in one go
+    nvic_set_priority(NVIC_TIM3_IRQ, 1);
+    nvic_enable_irq(NVIC_TIM3_IRQ);
+    timer_enable_irq(TIM3, TIM_DIER_UIE);
+
+    /* Halt the trajectory timer while debugging */
+    DBGMCU_CR |= DBGMCU_CR_TIM3_STOP;
+    timer_enable_counter(TIM3);
+}
+
+static uint32_t time_us(void) {
+    // Must be called with the TIM3 interrupt masked or from it
+    uint32_t count = timer_get_counter(TIM3);
+    uint32_t high = epoch;
+    if (timer_get_flag(TIM3, TIM_SR_UIF) && count < 0x8000) {
+        // overflowed, but the interrupt hasn't counted it yet
+        high += 0x10000;
+    }
+    return high | count;
+}
+
+static void play_due(void) {
+    // Applies every entry whose time has come, then sets the compare for
+    // the next. Entries further off than the timer range just match early.
+    while (state == TRAJ_RUNNING) {
+        if (head == tail) {
+            // ran out, adds are refused until aborted so a late refill
+            // isn't mistaken for part of this trajectory
+            state = TRAJ_DONE;
+            end_us = time_us();
+            timer_disable_irq(TIM3, TIM_DIER_CC1IE);
+            return;
+        }
+        const traj_entry_t* entry = &entries[head & TRAJ_MASK];
+        uint32_t due = start_us + entry->time_us;
+        int32_t late = (int32_t)(time_us() - due);
+        if (late < 0) {
+            timer_set_oc_value(TIM3, TIM_OC1, due & 0xFFFF);
+            timer_clear_flag(TIM3, TIM_SR_CC1IF);
+            // the count may have passed the compare while it was set
+            if ((int32_t)(time_us() - due) < 0) {
+                return;
+            }
+            continue;
+        }
+
+        output_set_power(entry->output_num, entry->value);
+        if ((uint32_t)late > max_late_us) {
+            max_late_us = (uint32_t)late;
+        }
+        played++;
+        head++;
+    }
+}
+
+void tim3_isr(void) {
+    if (timer_get_flag(TIM3, TIM_SR_UIF)) {
+        timer_clear_flag(TIM3, TIM_SR_UIF);
+        epoch += 0x10000;
+    }
+    if (timer_get_flag(TIM3, TIM_SR_CC1IF)) {
+        timer_clear_flag(TIM3, TIM_SR_CC1IF);
+        play_due();
+    }
+}
+
+uint8_t traj_free(void) {
+    return (uint8_t)(TRAJ_DEPTH - (uint8_t)(tail - head));
+}
+
+bool traj_add(const traj_entry_t* new_entries, uint8_t count) {
+    if (count > traj_free() || state == TRAJ_DONE) {
+        return false;
+    }
+    uint32_t previous = last_time_us;
+    for (uint8_t i = 0; i < count; i++) {
+        if (new_entries[i].time_us < previous || new_entries[i].time_us > TRAJ_MAX_TIME) {
+            return false;
+        }
+        previous = new_entries[i].time_us;
+    }
+
+    for (uint8_t i = 0; i < count; i++) {
+        entries[(tail + i) & TRAJ_MASK] = new_entries[i];
+    }
+    last_time_us = previous;
+    CM_ATOMIC_BLOCK() {
+        // Published once they are all written
+        tail += count;
+        if (state == TRAJ_RUNNING) {
+            // the compare may be waiting on nothing
+            play_due();
+        }
+    }
+    return true;
+}
+
+bool traj_start(void) {
+    if (state == TRAJ_RUNNING || head == tail) {
+        return false;
+    }
+    // The ramps and current loop would fight the playback
+    for (uint8_t i = 0; i < NUM_OUTPUTS; i++) {
+        torque_release(i);
+        ramp_stop(i);
+    }
+
+    CM_ATOMIC_BLOCK() {
+        played = 0;
+        max_late_us = 0;
+        start_us = time_us();
+        state = TRAJ_RUNNING;
+        timer_clear_flag(TIM3, TIM_SR_CC1IF);
+        timer_enable_irq(TIM3, TIM_DIER_CC1IE);
+        play_due();
+    }
+    return true;
+}
+
+void traj_stop(void) {
+    CM_ATOMIC_BLOCK() {
+        if (state == TRAJ_RUNNING) {
+            // as if the queue had run dry, so adds are refused until aborted
+            timer_disable_irq(TIM3, TIM_DIER_CC1IE);
+            head = tail;
+            state = TRAJ_DONE;
+            end_us = time_us();
+        }
+    }
+}
+
+void traj_abort(void) {
+    CM_ATOMIC_BLOCK() {
+        timer_disable_irq(TIM3, TIM_DIER_CC1IE);
+        state = TRAJ_IDLE;
+        head = tail;
+        last_time_us = 0;
+    }
+}
+
+void traj_get_status(traj_status_t* status) {
+    CM_ATOMIC_BLOCK() {
+        status->state = state;
+        status->played = played;
+        status->queued = (uint8_t)(tail - head);
+        status->max_late_us = max_late_us;
+        if (state == TRAJ_RUNNING) {
+            status->elapsed_us = time_us() - start_us;
+        } else if (state == TRAJ_DONE) {
+            status->elapsed_us = end_us - start_us;
+        } else {
+            status->elapsed_us = 0;
+        }
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Must be a power of two so the indices can wrap with a mask
+#define TRAJ_DEPTH 64
+// Entry times are offsets from the start, up to ~35 minutes
+#define TRAJ_MAX_TIME INT32_MAX  // us
+
+typedef enum {
+    TRAJ_IDLE,  // entries can be added, not started
+    TRAJ_RUNNING,
+    TRAJ_DONE,  // every entry has been played, or the buffer ran empty, until aborted
+    TRAJ_NUM_STATES,
+} traj_state_t;
+
+typedef struct {
+    uint32_t time_us;  // from the start of playback
+    uint8_t output_num;
+    int16_t value;  // motor power
+} traj_entry_t;
+
+typedef struct {
+    traj_state_t state;
+    uint32_t played;
+    uint8_t queued;
+    uint32_t elapsed_us;  // since the start, stops when done
+    uint32_t max_late_us;  // longest an entry was applied after its time
+} traj_status_t;
+
+void traj_init(void);
+// Entries must be in time order, also while running. Returns false without
+// adding any if they don't all fit, are out of order or the trajectory is done.
+bool traj_add(const traj_entry_t* entries, uint8_t count);
+uint8_t traj_free(void);
+// Returns false if there is nothing to play or it is already running
+bool traj_start(void);
+// Stops playback and removes the entries, the outputs keep their last value
+void traj_abort(void);
+// Ends a running trajectory for a manual setpoint, leaving it done
+void traj_stop(void);
+void traj_get_status(traj_status_t* status);
@@ -6,6 +6,75 @@
 #include "libopencm3/stm32/rcc.h"
 #include "libopencm3/stm32/gpio.h"
 #include "libopencm3/stm32/usart.h"
+#include "libopencm3/stm32/dma.h"
+#include "libopencm3/cm3/nvic.h"
+#include "libopencm3/cm3/cortex.h"
+
+#include "stats.h"
+#include "events.h"
+#include "clock.h"
+#include "sched.h"
+
+#define RX_BUFFER_MASK (USART_RX_BUFFER_SIZE - 1)
+// Set on the first byte stored after bytes were lost
+#define RX_GAP_FLAG 0x100
+
+// Single producer (usart1_isr), single consumer (main loop) ring buffer.
+// Each index is only ever written by one side so no locking is required.
+static volatile uint16_t rx_buffer[USART_RX_BUFFER_SIZE];
+static volatile uint16_t rx_head = 0;  // written by the ISR
+static volatile uint16_t rx_tail = 0;  // written by the main loop
+static bool rx_gap = false;  // bytes have been lost since the last stored one
+static uint32_t rx_gaps_read = 0;  // gap flags read by the main loop
+
+volatile usart_errors_t usart_errors = { 0 };
+
+// Rates the FTDI bridge and the 24MHz APB2 clock both divide to within 0.2%
+static const uint32_t supported_bauds[] = {
+    115200, 230400, 460800, 921600, 1000000, 1500000,
+};
+static uint32_t current_baud = 0;
+static uint32_t pending_baud = 0;  // applied once the response has been sent
+static bool pending_confirm = false;
+static bool awaiting_confirm = false;
+static uint32_t baud_change_time = 0;
+
+// Queue of response slots, the slot at tx_head is being sent by DMA
+static uint8_t tx_slots[USART_TX_SLOTS][USART_TX_SLOT_SIZE];
+static uint16_t tx_slot_len[USART_TX_SLOTS];
+static volatile uint8_t tx_head = 0;
+static volatile uint8_t tx_count = 0;  // slots queued, including the one in flight
+static bool tx_waiting = false;  // usart_send() is waiting for a free slot
+
+static void init_tx_dma(void) {
+    // USART1_TX is serviced by DMA1 channel 4
+    rcc_periph_clock_enable(RCC_DMA1);
+
+    dma_channel_reset(DMA1, DMA_CHANNEL4);
+    dma_set_peripheral_address(DMA1, DMA_CHANNEL4, (uint32_t)&USART_DR(USART1));
+    dma_set_read_from_memory(DMA1, DMA_CHANNEL4);
+    dma_enable_memory_increment_mode(DMA1, DMA_CHANNEL4);
+    dma_set_peripheral_size(DMA1, DMA_CHANNEL4, DMA_CCR_PSIZE_8BIT);
+    dma_set_memory_size(DMA1, DMA_CHANNEL4, DMA_CCR_MSIZE_8BIT);
+    dma_set_priority(DMA1, DMA_CHANNEL4, DMA_CCR_PL_LOW);
+    dma_enable_transfer_complete_interrupt(DMA1, DMA_CHANNEL4);
+
+    nvic_set_priority(NVIC_DMA1_CHANNEL4_IRQ, 2 << 4);
+    nvic_enable_irq(NVIC_DMA1_CHANNEL4_IRQ);
+
+    usart_enable_tx_dma(USART1);
+}
+
+static void start_tx_dma(uint8_t slot) {
+    dma_set_memory_address(DMA1, DMA_CHANNEL4, (uint32_t)tx_slots[slot]);
+    dma_set_number_of_data(DMA1, DMA_CHANNEL4, tx_slot_len[slot]);
+    // TC is set from reset and by the last transfer, cleared so it only
+    // shows idle once this one has left the shift register. The flags are
+    // cleared by writing 0, so writing 1 to the rest leaves them alone
+    // where a read-modify-write could clear an RXNE set in between.
+    USART_SR(USART1) = ~USART_SR_TC;
+    dma_enable_channel(DMA1, DMA_CHANNEL4);
+}
 
 void usart_init(void) {
     rcc_peripheral_enable_clock(&RCC_APB2ENR, RCC_APB2ENR_USART1EN);
@@ -13,33 +82,224 @@ void usart_init(void) {
     gpio_set_mode(GPIOA, GPIO_MODE_OUTPUT_10_MHZ,
                   GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, GPIO_USART1_TX);
 
-    usart_set_baudrate(USART1, 115200);
+    current_baud = USART_DEFAULT_BAUD;
+    usart_set_baudrate(USART1, current_baud);
     usart_set_databits(USART1, 8);
     usart_set_stopbits(USART1, USART_STOPBITS_1);
     usart_set_parity(USART1, USART_PARITY_NONE);
     usart_set_flow_control(USART1, USART_FLOWCONTROL_NONE);
     usart_set_mode(USART1, USART_MODE_TX_RX);
 
+    // Receive into the ring buffer from the interrupt, below the ADC priority
+    nvic_set_priority(NVIC_USART1_IRQ, 2 << 4);
+    nvic_enable_irq(NVIC_USART1_IRQ);
+    usart_enable_rx_interrupt(USART1);
+
+    init_tx_dma();
+
     usart_enable(USART1);
 }
 
-uint16_t usart_get_char(void) {
-    // Wait until the data is ready to be received.
-    while ((USART_SR(USART1) & USART_SR_RXNE) == 0)iwdg_reset();
-    return usart_recv(USART1);
+void usart1_isr(void) {
+    uint32_t status = USART_SR(USART1);
+
+    if (!(status & (USART_SR_RXNE | USART_SR_ORE))) {
+        return;
+    }
+
+    // Reading SR then DR clears the RXNE and error flags
+    uint8_t data = (uint8_t)(usart_recv(USART1) & 0xff);
+    uint16_t next_head = (rx_head + 1) & RX_BUFFER_MASK;
+
+    if (status & USART_SR_FE) {
+        usart_errors.framing++;
+        rx_gap = true;
+    } else if (status & USART_SR_NE) {
+        usart_errors.noise++;
+        rx_gap = true;
+    } else if (next_head == rx_tail) {
+        usart_errors.rx_full++;
+        rx_gap = true;
+    } else {
+        rx_buffer[rx_head] = data | (rx_gap?RX_GAP_FLAG:0);
+        rx_gap = false;
+        rx_head = next_head;
+        events_signal();
+    }
+
+    if (status & USART_SR_ORE) {
+        // The byte in DR is valid, the one after it was lost
+        usart_errors.overrun++;
+        rx_gap = true;
+    }
+}
+
+uint32_t usart_rx_gaps(void) {
+    // Number of points in the data read so far where bytes were lost, wraps
+    return rx_gaps_read;
+}
+
+bool usart_get_char(uint8_t* c) {
+    // Returns false if no data has been received
+    uint16_t tail = rx_tail;
+    if (tail == rx_head) {
+        return false;
+    }
+    uint16_t entry = rx_buffer[tail];
+    if (entry & RX_GAP_FLAG) {
+        rx_gaps_read++;
+    }
+    *c = (uint8_t)(entry & 0xff);
+    rx_tail = (tail + 1) & RX_BUFFER_MASK;
+    return true;
+}
+
+void dma1_channel4_isr(void) {
+    if (!dma_get_interrupt_flag(DMA1, DMA_CHANNEL4, DMA_TCIF)) {
+        return;
+    }
+    dma_clear_interrupt_flags(DMA1, DMA_CHANNEL4, DMA_TCIF);
+    dma_disable_channel(DMA1, DMA_CHANNEL4);
+
+    // Release the sent slot and move on to the next queued one
+    tx_head = (tx_head + 1) % USART_TX_SLOTS;
+    tx_count--;
+    if (tx_count != 0) {
+        start_tx_dma(tx_head);
+    }
+    // a slot is free for anything that was skipped
+    events_signal();
+}
+
+int usart_send(const uint8_t* data, uint16_t len) {
+    uint32_t start = stats_cycles();
+    uint16_t remaining = len;
+
+    while (remaining != 0) {
+        // Only wait if every slot is still queued
+        while (tx_count == USART_TX_SLOTS) {
+            iwdg_reset();
+            // Fault polling and the other tasks keep running through a
+            // long response, usart_tx_ready() keeps reports out of it
+            tx_waiting = true;
+            sched_run();
+            tx_waiting = false;
+            events_sleep();  // until the DMA interrupt or the next tick
+        }
+
+        uint8_t slot;
+        CM_ATOMIC_BLOCK() {
+            slot = (tx_head + tx_count) % USART_TX_SLOTS;
+        }
+
+        // The slot isn't visible to the ISR until it is counted below
+        uint16_t chunk = (remaining > USART_TX_SLOT_SIZE)?(USART_TX_SLOT_SIZE):(remaining);
+        memcpy(tx_slots[slot], data, chunk);
+        tx_slot_len[slot] = chunk;
+        data += chunk;
+        remaining -= chunk;
+
+        CM_ATOMIC_BLOCK() {
+            tx_count++;
+            if (tx_count == 1) {
+                start_tx_dma(slot);
+            }
+        }
+    }
+
+    stats_record(STATS_USART_TX, start);
+    return len;
 }
 
 int usart_send_string(char* str) {
-    uint16_t len = strlen(str);
+    return usart_send((const uint8_t*)str, strlen(str));
+}
+
+bool usart_tx_ready(void) {
+    // A send of up to one slot won't have to wait, or split a response
+    // that is waiting for a slot
+    return !tx_waiting && (tx_count < USART_TX_SLOTS);
+}
+
+bool usart_tx_idle(void) {
+    // TC is set once the final stop bit has left the shift register
+    return (tx_count == 0) && usart_get_flag(USART1, USART_SR_TC);
+}
 
-    for (uint16_t i=0; i<len; i++) {
+void usart_flush(void) {
+    while (!usart_tx_idle()) {
+        // TC doesn't interrupt, the tick wakes us to check it
         iwdg_reset();
-        if (str[i] == '\0') {
-            usart_send_blocking(USART1, '\n');
-        } else {
-            usart_send_blocking(USART1, str[i]);
+        events_sleep();
+    }
+}
+
+bool usart_baud_supported(uint32_t baud) {
+    for (uint8_t i = 0; i < (sizeof(supported_bauds) / sizeof(supported_bauds[0])); i++) {
+        if (supported_bauds[i] == baud) {
+            return true;
         }
     }
+    return false;
+}
+
+void usart_change_baud(uint32_t baud, bool confirm) {
+    // Switches once everything queued has been sent, so a response to the
+    // command goes out at the old rate. With confirm set the default is
+    // restored unless usart_confirm_baud() is called in time.
+    pending_baud = baud;
+    pending_confirm = confirm;
+}
+
+void usart_reset_baud(void) {
+    // Drops any change not yet applied or confirmed, then returns to the
+    // default rate once everything queued has been sent
+    awaiting_confirm = false;
+    pending_baud = 0;
+    if (current_baud != USART_DEFAULT_BAUD) {
+        usart_change_baud(USART_DEFAULT_BAUD, false);
+    }
+}
 
-    return len;
+bool usart_baud_change_pending(void) {
+    // Unsolicited output should hold off, the change waits for TX to go idle
+    return pending_baud != 0;
+}
+
+bool usart_confirm_baud(void) {
+    // Returns false if there is no change to confirm
+    if (!awaiting_confirm) {
+        return false;
+    }
+    awaiting_confirm = false;
+    return true;
+}
+
+uint32_t usart_get_baud(void) {
+    return current_baud;
+}
+
+static void apply_baud(uint32_t baud) {
+    // BRR may only be changed with the USART idle
+    usart_disable(USART1);
+    usart_set_baudrate(USART1, baud);
+    usart_enable(USART1);
+    current_baud = baud;
+    // The host's port switches too, errors around now are expected
+    rx_gap = false;
+}
+
+void usart_poll(void) {
+    if (pending_baud != 0 && usart_tx_idle()) {
+        apply_baud(pending_baud);
+        awaiting_confirm = pending_confirm;
+        baud_change_time = clock_millis();
+        pending_baud = 0;
+    }
+    if (awaiting_confirm && (clock_millis() - baud_change_time) > USART_BAUD_CONFIRM_MS) {
+        // the host never heard us at the new rate, switch back once
+        // anything still being sent has gone out
+        awaiting_confirm = false;
+        usart_change_baud(USART_DEFAULT_BAUD, false);
+    }
 }
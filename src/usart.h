@@ -1,8 +1,41 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
+
+// Must be a power of two so the indices can wrap with a mask
+#define USART_RX_BUFFER_SIZE 128
+// Responses are queued into these slots and sent by DMA
+#define USART_TX_SLOTS 2
+#define USART_TX_SLOT_SIZE 64
+// Used at power on and restored by *RESET or an unconfirmed change
+#define USART_DEFAULT_BAUD 115200
+// A new baud rate must be confirmed within this time
+#define USART_BAUD_CONFIRM_MS 1000
+
+typedef struct {
+    uint32_t overrun;  // bytes lost by the peripheral (ORE)
+    uint32_t framing;  // bytes dropped due to framing errors (FE)
+    uint32_t noise;  // bytes dropped due to line noise (NE)
+    uint32_t rx_full;  // bytes dropped because the receive buffer was full
+} usart_errors_t;
+// defined in usart.c
+extern volatile usart_errors_t usart_errors;
 
 void usart_init(void);
 
-uint16_t usart_get_char(void);
+bool usart_get_char(uint8_t* c);
+uint32_t usart_rx_gaps(void);
+int usart_send(const uint8_t* data, uint16_t len);
 int usart_send_string(char* str);
+bool usart_tx_ready(void);
+bool usart_tx_idle(void);
+void usart_flush(void);
+
+bool usart_baud_supported(uint32_t baud);
+void usart_change_baud(uint32_t baud, bool confirm);
+void usart_reset_baud(void);
+bool usart_baud_change_pending(void);
+bool usart_confirm_baud(void);
+uint32_t usart_get_baud(void);
+void usart_poll(void);